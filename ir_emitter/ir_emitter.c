@@ -8,13 +8,21 @@
 //  ---------------------------------------------------------------------------
 //  Specifications:
 //  Runs on 8-bit AVR Microcontrollers (ATmega series).
-//  The IR LED must be connected in the PD4 pin.
+//  The IR LED must be connected in the PD3 pin (OC2B). The TIMER2 generates
+//  the carrier and the TIMER0 times the levels, both are taken while the
+//  emitter is in use. A firmware that also links the reciever builds it
+//  without IR_OVERSAMPLING, whose engine needs the TIMER0 as well.
 //
 //*****************************************************************************
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <avr/io.h>
-#include <util/delay.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
 #include "ir_emitter.h"
 #include "bitwiseop.h"
 
@@ -24,7 +32,7 @@
 //
 //*****************************************************************************
 
-#define IR_LED                                      PD4
+#define IR_LED                                      PD3
 
 //
 //  Number of cycles the led is switching on and off within one pulse (1 bit).
@@ -32,9 +40,13 @@
 #define CYCLES                                      8
 
 //
-//  The frequency at which the led operates is 33 Khz, so period = 30.3 us.
+//  The carrier is the TIMER2 in Fast PWM Mode with a prescaler of 8 (0.5 us
+//  per tick), 16 MHz / 8 / (60 + 1) = 32.79 kHz, so period = 30.5 us. It is
+//  as close as the timer gets to the 32768 Hz crystal of the calculator.
 //
-#define PERIOD                                      30.3
+#define PERIOD                                      30.5
+#define CARRIER_TOP                                 60
+#define CARRIER_DUTY                                30
 
 //
 //  The duration of the three half bits at the beginning of a frame (us).
@@ -50,10 +62,45 @@
 //
 //  These low level timing defines the duration of the different '0's within the frame
 //
-#define LOW_LEVEL1_TIME                             HALF_BIT_TIME - (CYCLES * CYCLES_FREQUENCY)
+#define HIGH_LEVEL_TIME                             (CYCLES * PERIOD)
+#define LOW_LEVEL1_TIME                             (HALF_BIT_TIME - HIGH_LEVEL_TIME)
 #define LOW_LEVEL2_TIME                             HALF_BIT_TIME
-#define LOW_LEVEL3_TIME                             LOW_LEVEL1_TIME + LOW_LEVEL2_TIME
-#define LOW_LEVEL4_TIME                             LOW_LEVEL1_TIME + (2 * LOW_LEVEL2_TIME)
+#define LOW_LEVEL3_TIME                             (LOW_LEVEL1_TIME + LOW_LEVEL2_TIME)
+#define LOW_LEVEL4_TIME                             (LOW_LEVEL1_TIME + (2 * LOW_LEVEL2_TIME))
+
+//
+//  The levels are timed by the TIMER0 in CTC Mode with a prescaler of 64
+//  (4 us per tick). Levels longer than the 8-bit timer are split into
+//  several compare periods.
+//
+#define TICK_TIME                                   4
+#define TICKS(time)                                 ((uint16_t)((time) / TICK_TIME + 0.5))
+#define MAX_COMPARE_TICKS                           256
+
+//
+//  Levels of one frame: the opening half bits, two per codeword bit, the
+//  closing low level and the stop time.
+//
+#define FRAME_LEVELS                                32
+
+//
+//  Size of the queue of requests waiting to be sent. It must be a power of
+//  two, so the free running indices wrap with a mask.
+//
+#define REQUEST_QUEUE_SIZE                          4
+#define REQUEST_QUEUE_MASK                          (REQUEST_QUEUE_SIZE - 1)
+
+//
+//  Schedule of a predefined request, replayed without generating its levels.
+//  Every burst has the same length, so only the low levels between them are
+//  kept, in ticks over the shortest one: one byte each, or LONG_LOW followed
+//  by the 16-bit ticks. A request that does not fit is generated frame by
+//  frame.
+//
+#define SCHEDULE_SIZE                               192
+#define SHORT_LOW_TICKS                             TICKS(LOW_LEVEL1_TIME)
+#define LONG_LOW                                    0xFF
+#define NO_SCHEDULE                                 0xFF
 
 //*****************************************************************************
 //
@@ -67,504 +114,913 @@ enum Pulse_Level
   LOW_LEVEL1,
   LOW_LEVEL2,
   LOW_LEVEL3,
-  LOW_LEVEL4
+  LOW_LEVEL4,
+  STOP_LEVEL,
+  START_LEVEL
 };
 
 //*****************************************************************************
 //
-//  The following are enumerations for the commands available.
+//  The following are enumerations for the steps of a request.
 //
 //*****************************************************************************
 
-enum Commands
+enum Request_Step
 {
-  GET_COUNTER,
-  CLEAN_MEMORY
+  IDLE_STEP,
+  START_STEP,
+  START_TIME_STEP,
+  COMMAND_STEP,
+  STOP_STEP
 };
 
 //*****************************************************************************
 //
-//  The following arrays hold the required levels to form an specific
-//  ascii character based on the protocol.
+//  The following array holds the duration of each level in TIMER0 ticks.
+//  Like every constant table of the emitter, it stays in program memory.
 //
 //*****************************************************************************
 
-static const uint8_t g_ascii_ESC[] =
+static const uint16_t g_level_ticks[] PROGMEM =
 {
-  LOW_LEVEL2, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL4, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL4, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL4, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3
+  TICKS(HIGH_LEVEL_TIME),
+  TICKS(LOW_LEVEL1_TIME),
+  TICKS(LOW_LEVEL2_TIME),
+  TICKS(LOW_LEVEL3_TIME),
+  TICKS(LOW_LEVEL4_TIME),
+  TICKS(STOP_TIME * 1000),
+  TICKS(START_TIME * 1000)
 };
 
-static const uint8_t g_ascii_DP[] =
-{
-  LOW_LEVEL2, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL4, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL4, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL3
-};
+//*****************************************************************************
+//
+//  The following are defines for the "Red Eye" frame. Each byte is sent as a
+//  12-bit codeword, MSB first: four error bits and the 8 data bits. A bit is
+//  two half bits with one burst, in the first half for a 1 and in the second
+//  half for a 0. Each error bit is the parity of the data bits selected by
+//  its mask.
+//
+//*****************************************************************************
 
-static const uint8_t g_ascii_Y[] =
-{
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL4,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL1,
-  HIGH_LEVEL, LOW_LEVEL4,
-  HIGH_LEVEL, LOW_LEVEL1,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL4,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL1,
-  HIGH_LEVEL, LOW_LEVEL3
-};
+#define HALF_START_BITS                             3
+#define CODEWORD_BITS                               12
 
-static const uint8_t g_ascii_P[] =
-{
-  LOW_LEVEL2, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL4, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL4, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL4, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL1
-};
+#define ERROR_MASK_E3                               0x78
+#define ERROR_MASK_E2                               0xE6
+#define ERROR_MASK_E1                               0xD5
+#define ERROR_MASK_E0                               0x8B
 
-static const uint8_t g_ascii_3[] =
-{
-  LOW_LEVEL2, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL4, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3
-};
+#define PARITY(x)                                   \
+  ((((x) >> 7) ^ ((x) >> 6) ^ ((x) >> 5) ^ ((x) >> 4) ^ \
+    ((x) >> 3) ^ ((x) >> 2) ^ ((x) >> 1) ^ (x)) & 0x01)
 
-static const uint8_t g_ascii_M[] =
-{
-  LOW_LEVEL2, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL4, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL4, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL4, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL3
-};
+//
+//  Codeword of a constant byte, computed at compile time.
+//
+#define CODEWORD(data)                              \
+  ((uint16_t)((PARITY((data) & ERROR_MASK_E3) << 11) | \
+              (PARITY((data) & ERROR_MASK_E2) << 10) | \
+              (PARITY((data) & ERROR_MASK_E1) << 9) |  \
+              (PARITY((data) & ERROR_MASK_E0) << 8) |  \
+              (data)))
 
-static const uint8_t g_ascii_I[] =
-{
-  LOW_LEVEL2, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL4, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL4, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL4, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL3
-};
+//*****************************************************************************
+//
+//  The following arrays hold the codewords of the bytes that form an
+//  specific command. The levels of each frame are generated from its
+//  codeword, 2 bytes instead of up to 25 levels.
+//
+//*****************************************************************************
 
-static const uint8_t g_ascii_O[] =
+static const uint16_t g_start_cmd[] PROGMEM =
 {
-  LOW_LEVEL2, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL4, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL4, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3
+  CODEWORD(0x1B), CODEWORD(0xF9)
 };
 
-static const uint8_t g_ascii_F[] =
+static const uint16_t g_stop_cmd[] PROGMEM =
 {
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL4,
-  HIGH_LEVEL, LOW_LEVEL1,
-  HIGH_LEVEL, LOW_LEVEL4,
-  HIGH_LEVEL, LOW_LEVEL1,
-  HIGH_LEVEL, LOW_LEVEL4,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL1,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL4,
-  HIGH_LEVEL, LOW_LEVEL1
+  CODEWORD(0x0C), CODEWORD(0x04)
 };
 
-static const uint8_t g_ascii_FF[] =
+static const uint16_t g_get_counter_cmd[] PROGMEM =
 {
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL4,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL1,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL4,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL1
+  CODEWORD('Y'), CODEWORD('P'),
+  CODEWORD('3'), CODEWORD('M'),
+  CODEWORD('I'), CODEWORD('O'),
+  CODEWORD('F')
 };
 
-static const uint8_t g_ascii_EOT[] =
+static const uint16_t g_clean_memory_cmd[] PROGMEM =
 {
-  LOW_LEVEL2, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL4, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL4, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL1
+  CODEWORD('C'), CODEWORD('N'),
+  CODEWORD('F'), CODEWORD('G'),
+  CODEWORD(0x7F)
 };
 
-static const uint8_t g_ascii_C[] =
-{
-  HIGH_LEVEL, LOW_LEVEL4,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL1,
-  HIGH_LEVEL, LOW_LEVEL4,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL1,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL3
-};
+//*****************************************************************************
+//
+//  The following is the type of the requests waiting to be sent. A request
+//  given by its bytes (CUSTOM_COMMAND) points to them, they are encoded as
+//  they are sent.
+//
+//*****************************************************************************
 
-static const uint8_t g_ascii_N[] =
+struct Request
 {
-  LOW_LEVEL2, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL4, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL4, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL4, HIGH_LEVEL,
-  LOW_LEVEL1
+  uint8_t command;
+  const uint8_t* data;
+  uint8_t length;
 };
 
-static const uint8_t g_ascii_G[] =
-{
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL4,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL1,
-  HIGH_LEVEL, LOW_LEVEL4,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL1,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL3,
-  HIGH_LEVEL, LOW_LEVEL3
-};
+//*****************************************************************************
+//
+//  The following are global variables used to store the hooks called around
+//  every request, the requests waiting to be sent and the levels being sent.
+//
+//*****************************************************************************
 
-static const uint8_t g_ascii_DEL[] =
-{
-  LOW_LEVEL2, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL4, HIGH_LEVEL,
-  LOW_LEVEL1, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3, HIGH_LEVEL,
-  LOW_LEVEL3
-};
+static IR_Emitter_Hook g_on_start;
+static IR_Emitter_Hook g_on_stop;
+static IR_Send_Handler g_send_handler;
 
-static const uint8_t g_half_start_bits[] =
-{
-  HIGH_LEVEL, LOW_LEVEL1,
-  HIGH_LEVEL, LOW_LEVEL1,
-  HIGH_LEVEL, LOW_LEVEL1
-};
+//
+//  Request queue. The application puts the requests at the head and the
+//  TIMER0 ISR takes them from the tail once they are sent, both indices are
+//  free running.
+//
+static struct Request g_request_queue[REQUEST_QUEUE_SIZE];
+static volatile uint8_t g_request_head;
+static volatile uint8_t g_request_tail;
+
+//
+//  Request being sent: its step, the frame within the step and the
+//  codewords of the command, in program memory.
+//
+static uint8_t g_step;
+static uint8_t g_frame_index;
+static const uint16_t* g_command_codewords;
+static uint8_t g_command_length;
+
+//
+//  Levels of the frame being sent. The TIMER0 ISR walks g_levels, with
+//  g_ticks_left of the current level still to go, and loads the next frame
+//  as soon as the last level has started. g_is_sending is true while the
+//  TIMER0 runs.
+//
+static uint8_t g_levels[FRAME_LEVELS];
+static uint8_t g_level_cnt;
+static uint8_t g_level_index;
+static uint16_t g_ticks_left;
+static volatile bool g_is_sending;
+
+//
+//  Schedule cache. g_schedule holds the low levels of the request with
+//  g_schedule_command, rendered the first time it is sent while the emitter
+//  is idle. g_is_replaying is true while the TIMER0 ISR walks it instead of
+//  g_levels.
+//
+static uint8_t g_schedule[SCHEDULE_SIZE];
+static uint8_t g_schedule_length;
+static uint8_t g_schedule_command;
+static uint8_t g_schedule_index;
+static bool g_is_replaying;
 
 //*****************************************************************************
 //
-//  The following arrays hold the required ascii character to form an specific
-//  command.
+//  Prototypes for the private functions.
 //
 //*****************************************************************************
 
-static const uint8_t* g_start_cmd[] =
-{
-  g_ascii_ESC, g_ascii_DP
-};
+static void TIMER0_init(void);
+static void TIMER2_init(void);
+static void ir_led_transmission(uint8_t level);
+static void frame_transmission(uint16_t codeword);
+static void start_levels(void);
+static void load_levels(void);
+static bool request_step(void);
+static void start_request(const struct Request* request);
+static void set_command(uint8_t command, uint8_t length);
+static void finish_request(void);
+static void render_schedule(uint8_t command);
+static void wait_requests(void);
+static uint16_t get_codeword(uint8_t data);
 
-static const uint8_t* g_stop_cmd[] =
+//*****************************************************************************
+//
+//  Functions for the API.
+//
+//*****************************************************************************
+//*****************************************************************************
+//
+//! @brief Initialize hardware resources of the application.
+//!
+//! @return None.
+//
+//*****************************************************************************
+void
+IR_Emitter_init(void)
 {
-  g_ascii_FF, g_ascii_EOT
-};
+  //
+  //  Configure the IR LED as output and set low, it is driven by the
+  //  TIMER2 only during the bursts.
+  //
+  _set_bit(DDRD, IR_LED);
+  _clear_bit(PORTD, IR_LED);
 
-static const uint8_t* g_get_couter_cmd[] =
-{
-  g_ascii_Y, g_ascii_P,
-  g_ascii_3, g_ascii_M,
-  g_ascii_I, g_ascii_O,
-  g_ascii_F
-};
+  g_on_start = NULL;
+  g_on_stop = NULL;
+  g_send_handler = NULL;
+  g_request_head = 0;
+  g_request_tail = 0;
+  g_step = IDLE_STEP;
+  g_level_cnt = 0;
+  g_is_sending = false;
+  g_schedule_command = NO_SCHEDULE;
+  g_is_replaying = false;
 
-static const uint8_t* g_clean_memory_cmd[] =
-{
-  g_ascii_C, g_ascii_N,
-  g_ascii_F, g_ascii_G,
-  g_ascii_DEL
-};
+  TIMER2_init();
+  TIMER0_init();
+}
 
 //*****************************************************************************
 //
-//  The following arrays hold the length of each command.
+//! @brief Sets the hooks called before and after every request.
+//!
+//! On boards where the IR sensor sees the IR LED, the hooks gate the
+//! reciever, e.g. IR_Emitter_set_hooks(IR_Reciever_suspend,
+//! IR_Reciever_resume), so it does not capture the request itself. They are
+//! called from the TIMER0 ISR, except the start hook of a request sent while
+//! the emitter was idle.
+//!
+//! @param[in] on_start Called before the first burst, can be NULL.
+//! @param[in] on_stop Called after the last burst, can be NULL.
+//!
+//! @return None.
 //
 //*****************************************************************************
+void
+IR_Emitter_set_hooks(IR_Emitter_Hook on_start, IR_Emitter_Hook on_stop)
+{
+  g_on_start = on_start;
+  g_on_stop = on_stop;
+}
 
-static const uint8_t g_start_cmd_len[] =
+//*****************************************************************************
+//
+//! @brief Registers the handler called after every request is sent.
+//!
+//! The handler is called from the TIMER0 ISR after the last burst of the
+//! request, it must be short.
+//!
+//! @param[in] handler Function called with the command sent (Commands),
+//! NULL to disable it.
+//!
+//! @return None.
+//
+//*****************************************************************************
+void
+IR_on_sent(IR_Send_Handler handler)
 {
-  sizeof(g_ascii_ESC), sizeof(g_ascii_DP)
-};
+  g_send_handler = handler;
+}
 
-static const uint8_t g_stop_cmd_len[] =
+//*****************************************************************************
+//
+//! @brief Queues a request to the electronic people counter.
+//!
+//! Returns right away, the request is sent from the TIMER0 ISR, including
+//! opening and closing commands, once the ones before it are sent. The
+//! interrupts must be enabled.
+//!
+//! A command queued while the emitter is idle is rendered into the schedule
+//! cache, unless it is already there, and replayed from it.
+//!
+//! @param[in] command Action requested (Commands).
+//!
+//! @return True if queued, false if the queue is full.
+//
+//*****************************************************************************
+bool
+IR_send_async(uint8_t command)
 {
-  sizeof(g_ascii_FF), sizeof(g_ascii_EOT)
-};
+  uint8_t head = g_request_head;
+  struct Request* request;
+
+  if ((uint8_t)(head - g_request_tail) == REQUEST_QUEUE_SIZE)
+  {
+    return false;
+  }
+
+  //
+  //  The emitter is idle, so its levels can be used to render the schedule.
+  //
+  if (!g_is_sending && command != g_schedule_command &&
+      command != CUSTOM_COMMAND)
+  {
+    render_schedule(command);
+  }
 
-static const uint8_t g_get_counter_cmd_len[] =
+  request = &g_request_queue[head & REQUEST_QUEUE_MASK];
+  request->command = command;
+  request->data = NULL;
+  request->length = 0;
+
+  //
+  //  Publish the request only after it has been written.
+  //
+  g_request_head = head + 1;
+  start_levels();
+
+  return true;
+}
+
+//*****************************************************************************
+//
+//! @brief Indicates if the emitter has requests queued or being sent.
+//!
+//! @return True until the last burst of the last request.
+//
+//*****************************************************************************
+bool
+IR_is_sending(void)
 {
-  sizeof(g_ascii_Y), sizeof(g_ascii_P),
-  sizeof(g_ascii_3), sizeof(g_ascii_M),
-  sizeof(g_ascii_I), sizeof(g_ascii_O),
-  sizeof(g_ascii_F)
-};
+  return g_request_tail != g_request_head;
+}
 
-static const uint8_t g_clean_memory_cmd_len[] =
+//*****************************************************************************
+//
+//! @brief Sends a request to the electronic people counter.
+//!
+//! This function performs a complete transmision of one resquested command,
+//! including opening and closing commands. It returns once the request, and
+//! any queued before it, has been sent; the MCU sleeps meanwhile.
+//!
+//! @param[in] command Action requested.
+//!
+//! @return None.
+//
+//*****************************************************************************
+void
+IR_send_request(uint8_t command)
 {
-  sizeof(g_ascii_C), sizeof(g_ascii_N),
-  sizeof(g_ascii_F), sizeof(g_ascii_G),
-  sizeof(g_ascii_DEL)
-};
+  while (!IR_send_async(command))
+  {
+    wait_requests();
+  }
+  wait_requests();
+}
 
 //*****************************************************************************
 //
-//  Prototypes for the private functions.
+//! @brief Sends any command to the electronic people counter.
+//!
+//! Same as IR_send_request() for a command given as its bytes, which are
+//! encoded at runtime. The opening and closing commands are added.
+//!
+//! @param[in] data Bytes of the command.
+//! @param[in] length Number of bytes.
+//!
+//! @return None.
 //
 //*****************************************************************************
+void
+IR_send_bytes(const uint8_t* data, uint8_t length)
+{
+  struct Request* request;
 
-static void ir_led_transmission(uint8_t level);
-static void frame_transmission(const uint8_t* data_frame, uint8_t length);
-static void command_transmission(const uint8_t* frames[], const uint8_t* frames_length, uint8_t num_frames);
+  //
+  //  The bytes are read while they are sent, so the request is only queued
+  //  once the emitter is idle and this function waits for it.
+  //
+  wait_requests();
+
+  request = &g_request_queue[g_request_head & REQUEST_QUEUE_MASK];
+  request->command = CUSTOM_COMMAND;
+  request->data = data;
+  request->length = length;
+  g_request_head++;
+  start_levels();
+
+  wait_requests();
+}
 
 //*****************************************************************************
 //
-//  Functions for the API.
+//  Private Functions.
 //
 //*****************************************************************************
 //*****************************************************************************
 //
-//! @brief Initialize hardware resources of the application.
+//! @brief Initialize the TIMER2 as the carrier generator.
+//!
+//! Fast PWM Mode with OCR2A as TOP and a 50% duty cycle on OC2B. The timer
+//! runs all the time, the carrier only reaches the IR LED while OC2B is
+//! connected to the pin.
 //!
 //! @return None.
 //
 //*****************************************************************************
-void
-IR_Emitter_init(void)
+static void
+TIMER2_init(void)
 {
   //
-  //  Configure the IR LED as output and set low
+  //  Clear the TIMER2 registers.
+  //
+  TCCR2A = 0x00;
+  TCCR2B = 0x00;
+  TCNT2 = 0x00;
+
+  //
+  //  Fast PWM Mode Setup.
+  //  WGM22 - WGM20: Fast PWM, TOP = OCR2A.
+  //  CS21: Prescale 8 (0.5 us per tick).
   //
-  _setBit(DDRD, IR_LED);
-  _clearBit(PORTD, IR_LED);
+  OCR2A = CARRIER_TOP;
+  OCR2B = CARRIER_DUTY;
+  _set_two_bits(TCCR2A, WGM21, WGM20);
+  _set_two_bits(TCCR2B, WGM22, CS21);
 }
 
 //*****************************************************************************
 //
-//! @brief Sends a request to the electronic people counter.
+//! @brief Initialize the TIMER0 as the level timer.
 //!
-//! This function performs a complete transmision of one resquested command,
-//! including opening and closing commands.
+//! CTC Mode with a prescaler of 64 (4 us per tick). The timer is only
+//! clocked while requests are being sent.
 //!
-//! @param[in] command Action requested.
+//! @return None.
+//
+//*****************************************************************************
+static void
+TIMER0_init(void)
+{
+  //
+  //  Clear the TIMER0 registers.
+  //
+  TCCR0A = 0x00;
+  TCCR0B = 0x00;
+  TCNT0 = 0x00;
+
+  //
+  //  CTC Mode Setup.
+  //  WGM01: Clear Timer on Compare Match with OCR0A.
+  //
+  _set_bit(TCCR0A, WGM01);
+
+  //
+  //  Interrupt Service Routines Setup.
+  //  OCIE0A: Output Compare A.
+  //
+  _set_bit(TIFR0, OCF0A);
+  _set_bit(TIMSK0, OCIE0A);
+}
+
+//*****************************************************************************
+//
+//! @brief Sleeps until every queued request has been sent.
+//!
+//! Interrupts are disabled during the check, sei() only takes effect after
+//! the next instruction, so the end is not missed.
 //!
 //! @return None.
 //
 //*****************************************************************************
-void
-IR_send_request(uint8_t command)
+static void
+wait_requests(void)
 {
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  cli();
+  while (g_is_sending)
+  {
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+    cli();
+  }
+  sei();
+}
+
+//*****************************************************************************
+//
+//! @brief Loads the levels of a request just queued, if the emitter has
+//! none loaded.
+//!
+//! The TIMER0 ISR loads the next frame as soon as the last level of the
+//! current one, or of the schedule, has started, so it only runs out of
+//! levels when the queue was empty at that time. Then the levels are loaded
+//! here, and the TIMER0 is started unless it is still timing the last level.
+//!
+//! @return None.
+//
+//*****************************************************************************
+static void
+start_levels(void)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    if (g_level_cnt == 0 && !g_is_replaying)
+    {
+      load_levels();
+      g_level_index = 0;
+
+      if (!g_is_sending)
+      {
+        g_ticks_left = 0;
+        g_is_sending = true;
+
+        //
+        //  The first compare match loads the first level.
+        //  CS01 - CS00: Prescale 64 (4 us per tick).
+        //
+        TCNT0 = 0x00;
+        OCR0A = 0x00;
+        _set_two_bits(TCCR0B, CS01, CS00);
+      }
+    }
+  }
+}
+
+//*****************************************************************************
+//
+//! @brief Loads the levels of the next frame or silence.
+//!
+//! Called from the TIMER0 ISR once the last level loaded, or the last one
+//! of the schedule, has started, and by start_levels(). It moves through
+//! the steps of the request being sent and through the queued requests;
+//! g_level_cnt is left at 0 when there is nothing else to send, or when the
+//! next request is replayed from the schedule.
+//!
+//! @return None.
+//
+//*****************************************************************************
+static void
+load_levels(void)
+{
+  g_level_cnt = 0;
+
+  if (g_is_replaying)
+  {
+    g_is_replaying = false;
+    finish_request();
+  }
 
   //
-  //  Open the transmission with the start command
+  //  A send handler that queues a request loads it from within
+  //  finish_request(), so the loop also ends on a replay started there.
   //
-  command_transmission(g_start_cmd, g_start_cmd_len, sizeof(g_start_cmd_len));
-  _delay_ms(START_TIME);
+  while (g_level_cnt == 0 && !g_is_replaying)
+  {
+    if (g_step == IDLE_STEP)
+    {
+      if (g_request_tail == g_request_head)
+      {
+        return;
+      }
+      start_request(&g_request_queue[g_request_tail & REQUEST_QUEUE_MASK]);
+    }
+    else if (!request_step())
+    {
+      finish_request();
+    }
+  }
+}
 
+//*****************************************************************************
+//
+//! @brief Ends the request at the tail of the queue.
+//!
+//! Called once its last burst is over, the stop time goes on. The request
+//! is taken off the queue before the hook and the handler are called, as
+//! they may queue the next one.
+//!
+//! @return None.
+//
+//*****************************************************************************
+static void
+finish_request(void)
+{
+  uint8_t command = g_request_queue[g_request_tail &
+                                    REQUEST_QUEUE_MASK].command;
+
+  g_request_tail++;
+  g_step = IDLE_STEP;
+
+  if (g_on_stop)
+  {
+    g_on_stop();
+  }
+  if (g_send_handler)
+  {
+    g_send_handler(command);
+  }
+}
+
+//*****************************************************************************
+//
+//! @brief Starts sending a request.
+//!
+//! The request is replayed when its command is in the schedule cache.
+//!
+//! @param[in] request Request at the tail of the queue.
+//!
+//! @return None.
+//
+//*****************************************************************************
+static void
+start_request(const struct Request* request)
+{
+  if (g_on_start)
+  {
+    g_on_start();
+  }
+
+  set_command(request->command, request->length);
+  if (request->command == g_schedule_command)
+  {
+    g_schedule_index = 0;
+    g_is_replaying = true;
+  }
+}
+
+//*****************************************************************************
+//
+//! @brief Selects the codewords of a command and goes to its first step.
+//!
+//! @param[in] command Command of the request (Commands).
+//! @param[in] length Number of bytes of a CUSTOM_COMMAND.
+//!
+//! @return None.
+//
+//*****************************************************************************
+static void
+set_command(uint8_t command, uint8_t length)
+{
   //
   //  Check which command should be send next
   //
   switch (command)
   {
     case GET_COUNTER:
-      command_transmission(g_get_couter_cmd, g_get_couter_cmd_len, sizeof(g_get_couter_cmd_len));
+      g_command_codewords = g_get_counter_cmd;
+      g_command_length = sizeof(g_get_counter_cmd) / sizeof(uint16_t);
     break;
 
     case CLEAN_MEMORY:
-      command_transmission(g_clean_memory_cmd, g_clean_memory_cmd_len, sizeof(g_clean_memory_cmd_len));
+      g_command_codewords = g_clean_memory_cmd;
+      g_command_length = sizeof(g_clean_memory_cmd) / sizeof(uint16_t);
+    break;
+
+    default:
+      g_command_codewords = NULL;
+      g_command_length = length;
     break;
   }
 
-  //
-  //  Close the transmission with the stop command
-  //
-  command_transmission(g_stop_cmd, g_stop_cmd_len, sizeof(g_stop_cmd_len));
+  g_step = START_STEP;
+  g_frame_index = 0;
 }
 
 //*****************************************************************************
 //
-//  Private Functions.
+//! @brief Renders a predefined request into the schedule cache.
+//!
+//! The levels are generated frame by frame as when they are sent, and each
+//! run of low levels between two bursts is added up, so the replay has the
+//! same timing to the tick. Must be called while the emitter is idle, its
+//! levels are used.
+//!
+//! @param[in] command Predefined command of the request (Commands).
+//!
+//! @return None.
 //
 //*****************************************************************************
+static void
+render_schedule(uint8_t command)
+{
+  uint16_t low_ticks = 0;
+  uint8_t length = 0;
+  uint8_t i;
+
+  g_schedule_command = NO_SCHEDULE;
+  set_command(command, 0);
+
+  while (request_step())
+  {
+    for (i = 0; i < g_level_cnt; i++)
+    {
+      if (g_levels[i] != HIGH_LEVEL)
+      {
+        low_ticks += pgm_read_word(&g_level_ticks[g_levels[i]]);
+        continue;
+      }
+
+      //
+      //  A burst, the low levels before it are over. The request opens
+      //  with a burst.
+      //
+      if (low_ticks == 0)
+      {
+        continue;
+      }
+      if (length > SCHEDULE_SIZE - 3)
+      {
+        g_level_cnt = 0;
+        g_step = IDLE_STEP;
+        return;
+      }
+      if (low_ticks < SHORT_LOW_TICKS + LONG_LOW)
+      {
+        g_schedule[length++] = low_ticks - SHORT_LOW_TICKS;
+      }
+      else
+      {
+        g_schedule[length++] = LONG_LOW;
+        g_schedule[length++] = low_ticks & 0xFF;
+        g_schedule[length++] = low_ticks >> 8;
+      }
+      low_ticks = 0;
+    }
+    g_level_cnt = 0;
+  }
+  g_step = IDLE_STEP;
+
+  //
+  //  The request closes with the stop time.
+  //
+  if (length > SCHEDULE_SIZE - 3)
+  {
+    return;
+  }
+  g_schedule[length++] = LONG_LOW;
+  g_schedule[length++] = low_ticks & 0xFF;
+  g_schedule[length++] = low_ticks >> 8;
+  g_schedule_length = length;
+  g_schedule_command = command;
+}
+
 //*****************************************************************************
 //
-//! @brief Transmit a single command.
+//! @brief Loads the levels of the next frame of the request being sent.
 //!
-//! This performs a complete transmision of a single command. The command is
-//! sent by "Rey Eye" frames.
+//! A request opens with the start command and its silence, then the command
+//! itself, and closes with the stop command.
 //!
-//! @param[in] *frames[] Array of frames that comprise in a single command.
-//! @param[in] *frames_length Length of each frame in the command.
-//! @param[in] num_frames Number of frames included in the passed command.
-//!
-//! @return None.
+//! @return False if the request is over.
 //
 //*****************************************************************************
-static void
-command_transmission(const uint8_t* frames[], const uint8_t* frames_length, uint8_t num_frames);
+static bool
+request_step(void)
 {
-  for (uint8_t i = 0; i < num_frames; i++)
+  uint16_t codeword;
+
+  switch (g_step)
   {
-    //
-    //  Transmission of the four error bits and the 8 data bits
-    //  of the frame (ascii character).
-    //
-    frame_transmission(frames[i], frames_length[i]);
+    case START_STEP:
+      codeword = pgm_read_word(&g_start_cmd[g_frame_index]);
+      if (++g_frame_index == sizeof(g_start_cmd) / sizeof(uint16_t))
+      {
+        g_step = START_TIME_STEP;
+      }
+      frame_transmission(codeword);
+    break;
+
+    case START_TIME_STEP:
+      ir_led_transmission(START_LEVEL);
+      g_step = (g_command_length != 0) ? COMMAND_STEP : STOP_STEP;
+      g_frame_index = 0;
+    break;
+
+    case COMMAND_STEP:
+      if (g_command_codewords)
+      {
+        codeword = pgm_read_word(&g_command_codewords[g_frame_index]);
+      }
+      else
+      {
+        codeword = get_codeword(g_request_queue[g_request_tail &
+                                REQUEST_QUEUE_MASK].data[g_frame_index]);
+      }
+      if (++g_frame_index == g_command_length)
+      {
+        g_step = STOP_STEP;
+        g_frame_index = 0;
+      }
+      frame_transmission(codeword);
+    break;
+
+    case STOP_STEP:
+      if (g_frame_index == sizeof(g_stop_cmd) / sizeof(uint16_t))
+      {
+        return false;
+      }
+      frame_transmission(pgm_read_word(&g_stop_cmd[g_frame_index++]));
+    break;
   }
+
+  return true;
 }
 
 //*****************************************************************************
 //
 //! @brief Transmit a single frame.
 //!
-//! This performs a complete transmision of a single frame, including opening
-//! and closing half bits of the frame.
+//! This queues the levels of a single frame, including opening and closing
+//! half bits of the frame. The levels are generated from the codeword: a 1
+//! is a burst followed by a low level of one and a half bits (LOW_LEVEL3),
+//! a 0 is a low level of a half bit (LOW_LEVEL2) followed by a burst.
+//! Consecutive low levels are sent as one.
 //!
-//! @param[in] data_frame An specific ascii character.
-//! @param[in] length Length of the frame.
+//! @param[in] codeword Error bits and data bits of the frame.
 //!
 //! @return None.
 //
 //*****************************************************************************
 static void
-frame_transmission(const uint8_t* data_frame, uint8_t length)
+frame_transmission(uint16_t codeword)
 {
+  uint8_t low_level;
   uint8_t i;
 
-  for (i = 0; i < sizeof(half_start_bits); i++)
+  //
+  //  Transmission of the opening three half-start-bits included
+  //  in the frame.
+  //
+  for (i = 0; i < HALF_START_BITS; i++)
   {
-    //
-    //  Transmission of the opening three half-start-bits included
-    //  in the frame.
-    //
-    ir_led_transmission(*half_start_bits++);
+    if (i != 0)
+    {
+      ir_led_transmission(LOW_LEVEL1);
+    }
+    ir_led_transmission(HIGH_LEVEL);
   }
+  low_level = LOW_LEVEL1;
 
   //
-  //  Loop through the data array to passed the pulse duration levels
-  //  to the ir led.
+  //  Transmission of the four error bits and the 8 data bits. The low level
+  //  after each burst is held until the next burst.
   //
-  for (i = 0; i < length; i++)
+  for (i = 0; i < CODEWORD_BITS; i++)
   {
-    ir_led_transmission(*data_frame++);
+    if (codeword & (1 << (CODEWORD_BITS - 1)))
+    {
+      ir_led_transmission(low_level);
+      ir_led_transmission(HIGH_LEVEL);
+      low_level = LOW_LEVEL3;
+    }
+    else
+    {
+      low_level = (low_level == LOW_LEVEL1) ? LOW_LEVEL3 : LOW_LEVEL4;
+      ir_led_transmission(low_level);
+      ir_led_transmission(HIGH_LEVEL);
+      low_level = LOW_LEVEL1;
+    }
+    codeword <<= 1;
   }
+  ir_led_transmission(low_level);
 
   //
   //  Fixed time between frame transmission.
   //
-  _delay_ms(STOP_TIME);
+  ir_led_transmission(STOP_LEVEL);
 }
 
 //*****************************************************************************
 //
-//! @brief Transmit a single level.
+//! @brief Computes the codeword of a byte at runtime.
 //!
-//! This function evalutes the level passed to define if the IR LED has be set
-//! to High (switching on and off), or has to be keep off for a certain time.
+//! @param[in] data Byte to send.
 //!
-//! @param[in] level The IR LED state, either on or off.
+//! @return The four error bits followed by the 8 data bits.
+//
+//*****************************************************************************
+static uint16_t
+get_codeword(uint8_t data)
+{
+  static const uint8_t error_masks[] PROGMEM =
+  {
+    ERROR_MASK_E3, ERROR_MASK_E2, ERROR_MASK_E1, ERROR_MASK_E0
+  };
+  uint16_t codeword = 0;
+
+  for (uint8_t i = 0; i < sizeof(error_masks); i++)
+  {
+    uint8_t bits = data & pgm_read_byte(&error_masks[i]);
+
+    bits ^= bits >> 4;
+    bits ^= bits >> 2;
+    bits ^= bits >> 1;
+    codeword = (codeword << 1) | (bits & 0x01);
+  }
+
+  return (codeword << 8) | data;
+}
+
+//*****************************************************************************
+//
+//! @brief Queue a single level.
+//!
+//! @param[in] level The IR LED state, either on or off (Pulse_Level).
 //!
 //! @return None.
 //
@@ -572,41 +1028,101 @@ frame_transmission(const uint8_t* data_frame, uint8_t length)
 static void
 ir_led_transmission(uint8_t level)
 {
-  uint8_t cycles;
-  switch (level)
+  g_levels[g_level_cnt++] = level;
+}
+
+//*****************************************************************************
+//
+//  Interrupt Service Routines
+//
+//*****************************************************************************
+//*****************************************************************************
+//
+//! @brief ISR vector for the TIMER0 Compare Match A.
+//!
+//! Reached at the end of each compare period. When the current level is
+//! over, the next one switches the carrier on (HIGH_LEVEL) or off by
+//! connecting or disconnecting OC2B; the TIMER2 is set to TOP so the first
+//! cycle of a burst is a full one. Once the last level of the frame has
+//! started the next frame is loaded, well within the stop time. When there
+//! is nothing else to send the TIMER0 is stopped.
+//!
+//! A replayed request alternates bursts and the low levels of the schedule,
+//! without looking up the levels.
+//
+//*****************************************************************************
+ISR (TIMER0_COMPA_vect)
+{
+  uint16_t ticks = g_ticks_left;
+
+  if (ticks == 0 && g_is_replaying)
   {
-    case HIGH_LEVEL:
-      //
-      //  Transmit 8 cycles at 33kHz
-      //
-      for (cycles = 0; cycles < CYCLES; cycles++)
+    if (_read_bit(TCCR2A, COM2B1))
+    {
+      _clear_bit(TCCR2A, COM2B1);
+      ticks = g_schedule[g_schedule_index++];
+      if (ticks == LONG_LOW)
       {
-        _setBit(PORTD, IR_LED);
-        _delay_us(PERIOD / 2);
-        _clearBit(PORTD, IR_LED);
-        _delay_us(PERIOD / 2);
+        ticks = g_schedule[g_schedule_index] |
+                (g_schedule[g_schedule_index + 1] << 8);
+        g_schedule_index += 2;
       }
-    break;
-
-    //
-    //  The low level produces the same state in the IR LED 0,
-    //  but as the level increases (1, 2, 3...) the time increases as well.
-    //
+      else
+      {
+        ticks += SHORT_LOW_TICKS;
+      }
+    }
+    else
+    {
+      TCNT2 = CARRIER_TOP;
+      _set_bit(TCCR2A, COM2B1);
+      ticks = TICKS(HIGH_LEVEL_TIME);
+    }
+  }
+  else if (ticks == 0)
+  {
+    uint8_t level;
 
-    case LOW_LEVEL1:
-      _delay_us(LOW_LEVEL1_TIME);
-    break;
+    if (g_level_index == g_level_cnt)
+    {
+      _clear_two_bits(TCCR0B, CS01, CS00);
+      _clear_bit(TCCR2A, COM2B1);
+      g_is_sending = false;
+      return;
+    }
 
-    case LOW_LEVEL2:
-      _delay_us(LOW_LEVEL2_TIME);
-    break;
+    level = g_levels[g_level_index++];
+    if (level == HIGH_LEVEL)
+    {
+      TCNT2 = CARRIER_TOP;
+      _set_bit(TCCR2A, COM2B1);
+    }
+    else
+    {
+      _clear_bit(TCCR2A, COM2B1);
+    }
+    ticks = pgm_read_word(&g_level_ticks[level]);
+  }
 
-    case LOW_LEVEL3:
-      _delay_us(LOW_LEVEL3_TIME);
-    break;
+  //
+  //  The CTC period is OCR0A + 1 ticks.
+  //
+  if (ticks > MAX_COMPARE_TICKS)
+  {
+    OCR0A = MAX_COMPARE_TICKS - 1;
+    ticks -= MAX_COMPARE_TICKS;
+  }
+  else
+  {
+    OCR0A = ticks - 1;
+    ticks = 0;
+  }
+  g_ticks_left = ticks;
 
-    case LOW_LEVEL4:
-      _delay_us(LOW_LEVEL4_TIME);
-    break;
+  if (g_is_replaying ? g_schedule_index == g_schedule_length :
+      g_level_index == g_level_cnt)
+  {
+    load_levels();
+    g_level_index = 0;
   }
 }
@@ -8,13 +8,45 @@
 //  ---------------------------------------------------------------------------
 //  Specifications:
 //  Runs on 8-bit AVR Microcontrollers (ATmega series).
-//  The IR LED must be connected in the PD4 pin.
+//  The IR LED must be connected in the PD3 pin (OC2B).
 //
 //*****************************************************************************
 
 #ifndef __EMITTER_H__
 #define __EMITTER_H__
 
+//*****************************************************************************
+//
+//  The following are enumerations for the commands available. A command
+//  sent by its bytes through IR_send_bytes() is reported as CUSTOM_COMMAND.
+//
+//*****************************************************************************
+
+enum Commands
+{
+  GET_COUNTER,
+  CLEAN_MEMORY,
+  CUSTOM_COMMAND
+};
+
+//*****************************************************************************
+//
+//  The following is the type of the hooks called around every request, see
+//  IR_Emitter_set_hooks().
+//
+//*****************************************************************************
+
+typedef void (*IR_Emitter_Hook)(void);
+
+//*****************************************************************************
+//
+//  The following is the type of the handler called after every request is
+//  sent, see IR_on_sent().
+//
+//*****************************************************************************
+
+typedef void (*IR_Send_Handler)(uint8_t command);
+
 //*****************************************************************************
 //
 //  Prototypes for the API
@@ -22,6 +54,11 @@
 //*****************************************************************************
 
 extern void IR_Emitter_init(void);
+extern void IR_Emitter_set_hooks(IR_Emitter_Hook on_start, IR_Emitter_Hook on_stop);
+extern void IR_on_sent(IR_Send_Handler handler);
+extern bool IR_send_async(uint8_t command);
+extern bool IR_is_sending(void);
 extern void IR_send_request(uint8_t command);
+extern void IR_send_bytes(const uint8_t* data, uint8_t length);
 
 #endif
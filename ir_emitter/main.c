@@ -8,31 +8,36 @@
 //  Specifications:
 //  The following code was tested in an atmega328p to send predefined commands
 //  to another microcontroller running the ir_receiver code. The IR LED should
-//  be connected to PD4 for infrared signal transmission.
+//  be connected to PD3 (OC2B) for infrared signal transmission, the carrier
+//  is only available on that pin (it was PD4 before the TIMER2 carrier).
 //
 //*****************************************************************************
 
+#include <stdint.h>
+#include <stdbool.h>
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <util/delay.h>
 #include "ir_emitter.h"
 
 void main()
 {
   //
-  //  Initialize the IR emitter
+  //  Initialize the IR emitter, the requests are sent from its interrupts.
   //
   IR_Emitter_init();
+  sei();
 
   //
-  //  Send the clean memory command once
+  //  Queue the clean memory command once
   //
-  IR_send_request(CLEAN_MEMORY);
+  IR_send_async(CLEAN_MEMORY);
   while(1)
   {
     //
-    //  Request the count every second
+    //  Request the count every second, the main loop is free meanwhile
     //
-    IR_send_request(GET_COUNTER);
+    IR_send_async(GET_COUNTER);
     _delay_ms(1000);
   }
 }
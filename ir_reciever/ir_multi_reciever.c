@@ -0,0 +1,504 @@
+//*****************************************************************************
+//
+//  API and private functions for the multi IR Sensor engine.
+//  File:     ir_multi_reciever.c
+//  Version:  1.0v
+//  Author:   Ronald Rodriguez Ruiz.
+//  ---------------------------------------------------------------------------
+//  Specifications:
+//  Runs on 8-bit AVR Microcontrollers (ATmega series).
+//  Up to eight IR Sensors share one port, each one has to operate in a
+//  frequency of 33 Khz. It is recommended to implement the Vishay TSOP Series
+//  33 kHz Infrared Receivers.
+//
+//  Alternative to the Input Capture engine of ir_reciever.c, which is bound
+//  to the ICP1 pin. The TIMER2 samples the whole port at a fixed rate and
+//  every channel is decoded at once with bitwise (bit-sliced) operations:
+//  bit n of each state byte below belongs to the sensor on pin n, so the
+//  cost of one sample is the same for one or eight sensors.
+//
+//  Standalone module: neither IR_Reciever_init() nor the main.c programs
+//  start it, the application calls IR_Multi_Reciever_init() itself. It
+//  only shares IR_check_codeword() with ir_reciever.c. It takes the
+//  TIMER2, so it can not be linked with the emitter, whose carrier runs
+//  on that timer.
+//
+//*****************************************************************************
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "ir_reciever.h"
+#include "ir_multi_reciever.h"
+#include "bitwiseop.h"
+
+//*****************************************************************************
+//
+//  The following are defines for the port shared by the IR Sensors. PD0 and
+//  PD1 are left to the UART, so six sensors are wired to PD2 - PD7 by
+//  default. Any port works, the mask selects the pins holding a sensor.
+//
+//*****************************************************************************
+
+#define MULTI_PIN                     PIND
+#define MULTI_DDR                     DDRD
+#define MULTI_CHANNEL_MASK            0xFC
+
+//*****************************************************************************
+//
+//  The following are defines for the sampling of the port. The port is read
+//  4 times per half bit (427.25 us): 53 ticks of 2 us = 106 us.
+//
+//*****************************************************************************
+
+#define SAMPLE_PERIOD_TICKS           53
+
+//
+//  The distance between two bursts is measured in samples by a vertical
+//  counter of INTERVAL_PLANES bits per channel. It restarts at
+//  INTERVAL_OFFSET on each burst, so with 4 samples per half bit the two
+//  upper planes give the number of half bits directly:
+//   4 -  7: 1 half bit  (plane 2)
+//   8 - 11: 2 half bits (plane 3)
+//  12 - 15: 3 half bits (planes 3 and 2)
+//  16 - 31: gap between frames (plane 4, saturated at 31)
+//  Anything below 4 is a glitch.
+//
+#define INTERVAL_PLANES               5
+#define INTERVAL_OFFSET               2
+
+//
+//  Each frame has 15 bursts: 3 opening half bits and one per codeword bit.
+//
+#define BURST_PLANES                  4
+#define CODEWORD_BITS                 12
+
+//
+//  Size of the queue that holds the decoded bytes until the user reads them.
+//  It must be a power of two, so the free running indices wrap with a mask.
+//
+#define MULTI_QUEUE_SIZE              16
+#define MULTI_QUEUE_MASK              (MULTI_QUEUE_SIZE - 1)
+
+//*****************************************************************************
+//
+//  The following are global varabiles used to store the state of every
+//  channel, one bit per channel, only used by the ISR.
+//
+//*****************************************************************************
+
+static uint8_t g_last_level;
+
+//
+//  Vertical counters, g_interval[i] holds bit i of the samples elapsed since
+//  the last burst and g_burst_cnt[i] bit i of the bursts within the frame.
+//
+static uint8_t g_interval[INTERVAL_PLANES];
+static uint8_t g_burst_cnt[BURST_PLANES];
+
+//
+//  Half bit position of the last burst is odd (1) or even (0). A codeword
+//  bit is 1 when its burst is sent in the first half, which is always an
+//  odd half bit position counted from the first opening burst.
+//
+static uint8_t g_slot_parity;
+static uint8_t g_valid_channels;
+
+//
+//  Codeword shift registers, g_codeword[i] holds bit i of every channel.
+//
+static uint8_t g_codeword[CODEWORD_BITS];
+
+//
+//  Single-producer/single-consumer queue of decoded bytes. The ISR only
+//  writes g_multi_head and the user only writes g_multi_tail.
+//
+static volatile uint8_t g_multi_head;
+static volatile uint8_t g_multi_tail;
+static volatile uint8_t g_multi_overruns;
+static uint8_t g_multi_queue[MULTI_QUEUE_SIZE];
+static uint8_t g_multi_channel[MULTI_QUEUE_SIZE];
+static uint8_t g_multi_status[MULTI_QUEUE_SIZE];
+
+//*****************************************************************************
+//
+//  Prototypes for the private functions.
+//
+//*****************************************************************************
+
+static void TIMER2_init(void);
+static inline void decode_bursts(uint8_t fall);
+static void end_frames(uint8_t channels);
+static void multi_queue_put(uint8_t channel, uint8_t data, uint8_t status);
+
+//*****************************************************************************
+//
+//  Functions for the API.
+//
+//*****************************************************************************
+//*****************************************************************************
+//
+//! @brief Initialize the software and hardware resources of the engine.
+//!
+//! @return None.
+//
+//*****************************************************************************
+void
+IR_Multi_Reciever_init(void)
+{
+  uint8_t i;
+
+  g_multi_head = 0;
+  g_multi_tail = 0;
+  g_multi_overruns = 0;
+  g_last_level = 0;
+  g_slot_parity = 0;
+  g_valid_channels = 0;
+
+  //
+  //  Start with saturated counters, so the first burst of every channel
+  //  opens a frame.
+  //
+  for (i = 0; i < INTERVAL_PLANES; i++)
+  {
+    g_interval[i] = 0xFF;
+  }
+
+  for (i = 0; i < BURST_PLANES; i++)
+  {
+    g_burst_cnt[i] = 0;
+  }
+
+  //
+  //  Sensor pins as inputs, the TSOP output has its own pull-up.
+  //
+  MULTI_DDR &= ~MULTI_CHANNEL_MASK;
+
+  TIMER2_init();
+}
+
+//*****************************************************************************
+//
+//! @brief Returns the number of decoded bytes waiting to be read.
+//!
+//! @return Number of bytes available through IR_multi_read().
+//
+//*****************************************************************************
+uint8_t
+IR_multi_available(void)
+{
+  return (uint8_t)(g_multi_head - g_multi_tail);
+}
+
+//*****************************************************************************
+//
+//! @brief Reads the oldest decoded byte of any channel.
+//!
+//! @note IR_multi_available() must be checked first, reading an empty queue
+//! returns 0.
+//!
+//! @param[out] channel Port pin of the sensor that recieved the byte, it can
+//! be NULL if not needed.
+//! @param[out] status Error bits check of the byte (IR_Byte_Status), it can
+//! be NULL if not needed.
+//!
+//! @return data Decoded byte.
+//
+//*****************************************************************************
+uint8_t
+IR_multi_read(uint8_t* channel, uint8_t* status)
+{
+  uint8_t data = 0;
+  uint8_t tail = g_multi_tail;
+
+  if (tail != g_multi_head)
+  {
+    data = g_multi_queue[tail & MULTI_QUEUE_MASK];
+    if (channel)
+    {
+      *channel = g_multi_channel[tail & MULTI_QUEUE_MASK];
+    }
+    if (status)
+    {
+      *status = g_multi_status[tail & MULTI_QUEUE_MASK];
+    }
+
+    //
+    //  Release the slot only after the byte has been copied.
+    //
+    g_multi_tail = tail + 1;
+  }
+
+  return data;
+}
+
+//*****************************************************************************
+//
+//! @brief Returns how many decoded bytes were lost because the queue was
+//! full.
+//!
+//! @return Number of overruns since the initialization.
+//
+//*****************************************************************************
+uint8_t
+IR_multi_get_overruns(void)
+{
+  return g_multi_overruns;
+}
+
+//*****************************************************************************
+//
+//  Private Functions.
+//
+//*****************************************************************************
+//*****************************************************************************
+//
+//! @brief Initialize the TIMER2 in CTC Mode.
+//!
+//! The TIMER2 runs with a prescaler of 32 (2 us per tick at 16 MHz) and
+//! clears on OCR2A, so the Output Compare A ISR samples the port every
+//! SAMPLE_PERIOD_TICKS.
+//!
+//! @return None.
+//
+//*****************************************************************************
+static void
+TIMER2_init(void)
+{
+  //
+  //  Clear the TIMER2 registers.
+  //
+  TCCR2A = 0x00;
+  TCCR2B = 0x00;
+  TCNT2 = 0x00;
+
+  //
+  //  CTC Mode Setup.
+  //  WGM21: Clear Timer on Compare Match with OCR2A.
+  //  CS21 - CS20: Prescale 32 (2 us per tick).
+  //
+  OCR2A = SAMPLE_PERIOD_TICKS - 1;
+  _set_bit(TCCR2A, WGM21);
+  _set_two_bits(TCCR2B, CS21, CS20);
+
+  //
+  //  Interrupt Service Routines Setup.
+  //  OCIE2A: Output Compare A.
+  //
+  _set_bit(TIFR2, OCF2A);
+  _set_bit(TIMSK2, OCIE2A);
+}
+
+//*****************************************************************************
+//
+//! @brief Updates the frame state of every channel that starts a burst.
+//!
+//! The distance to the previous burst, in half bits, tells whether a new
+//! frame starts (gap), moves the half bit position of the frame and checks
+//! the opening half bits. Every burst after them carries one codeword bit,
+//! which is shifted in for all the channels at once.
+//!
+//! @param[in] fall Channels where a burst started in this sample.
+//!
+//! @return None.
+//
+//*****************************************************************************
+static inline void
+decode_bursts(uint8_t fall)
+{
+  uint8_t i;
+  uint8_t tmp;
+  uint8_t carry;
+  uint8_t data;
+  uint8_t gap = fall & g_interval[4];
+  uint8_t odd = g_interval[2] & ~g_interval[4];
+  uint8_t one_half = odd & ~g_interval[3];
+  uint8_t glitch = ~(g_interval[4] | g_interval[3] | g_interval[2]);
+
+  //
+  //  Restart the interval of the channels with a burst.
+  //
+  g_interval[0] &= ~fall;
+  g_interval[1] |= fall;
+  g_interval[2] &= ~fall;
+  g_interval[3] &= ~fall;
+  g_interval[4] &= ~fall;
+
+  //
+  //  Count the burst, after a gap it is the first one of a new frame.
+  //
+  carry = fall;
+  for (i = 0; i < BURST_PLANES; i++)
+  {
+    tmp = g_burst_cnt[i] & carry;
+    g_burst_cnt[i] ^= carry;
+    carry = tmp;
+  }
+
+  g_burst_cnt[0] |= gap;
+  g_burst_cnt[1] &= ~gap;
+  g_burst_cnt[2] &= ~gap;
+  g_burst_cnt[3] &= ~gap;
+  g_slot_parity &= ~gap;
+  g_valid_channels |= gap;
+
+  //
+  //  A gap has no odd bit set, so the new frames keep an even position.
+  //
+  g_slot_parity ^= fall & odd;
+  g_valid_channels &= ~(fall & glitch);
+
+  //
+  //  Bursts 2 and 3 must follow the previous one by exactly one half bit.
+  //
+  tmp = g_burst_cnt[1] & ~g_burst_cnt[2] & ~g_burst_cnt[3];
+  g_valid_channels &= ~(fall & tmp & ~one_half);
+
+  //
+  //  Bursts 4 to 15 carry the codeword, MSB first.
+  //
+  data = fall & g_valid_channels & (g_burst_cnt[2] | g_burst_cnt[3]);
+  if (data == 0)
+  {
+    return;
+  }
+
+  for (i = CODEWORD_BITS - 1; i > 0; i--)
+  {
+    g_codeword[i] = (g_codeword[i] & ~data) | (g_codeword[i - 1] & data);
+  }
+  g_codeword[0] = (g_codeword[0] & ~data) | (g_slot_parity & data);
+
+  //
+  //  The 15th burst holds the last data bit.
+  //
+  data &= g_burst_cnt[0] & g_burst_cnt[1] & g_burst_cnt[2] & g_burst_cnt[3];
+  if (data)
+  {
+    g_valid_channels &= ~data;
+    end_frames(data);
+  }
+}
+
+//*****************************************************************************
+//
+//! @brief Checks and queues the codeword of every channel with a complete
+//! frame.
+//!
+//! @param[in] channels Channels that recieved their last codeword bit.
+//!
+//! @return None.
+//
+//*****************************************************************************
+static void
+end_frames(uint8_t channels)
+{
+  uint8_t i;
+  uint8_t data;
+  uint8_t status;
+  uint8_t channel;
+  uint16_t codeword;
+
+  for (channel = 0; channel < 8; channel++)
+  {
+    if (!_read_bit(channels, channel))
+    {
+      continue;
+    }
+
+    //
+    //  Gather the 12 bits of this channel from the codeword planes.
+    //
+    codeword = 0;
+    for (i = CODEWORD_BITS; i > 0; i--)
+    {
+      codeword <<= 1;
+      if (_read_bit(g_codeword[i - 1], channel))
+      {
+        _set_bit(codeword, 0);
+      }
+    }
+
+    status = IR_check_codeword(codeword, &data);
+    multi_queue_put(channel, data, status);
+  }
+}
+
+//*****************************************************************************
+//
+//! @brief Puts one decoded byte in the queue.
+//!
+//! If the queue is full the byte is dropped and the overrun counter is
+//! increased, the bytes already queued are never overwritten.
+//!
+//! @param[in] channel Port pin of the sensor.
+//! @param[in] data Decoded byte.
+//! @param[in] status Error bits check of the byte.
+//!
+//! @return None.
+//
+//*****************************************************************************
+static void
+multi_queue_put(uint8_t channel, uint8_t data, uint8_t status)
+{
+  uint8_t head = g_multi_head;
+
+  if ((uint8_t)(head - g_multi_tail) >= MULTI_QUEUE_SIZE)
+  {
+    g_multi_overruns++;
+    return;
+  }
+
+  g_multi_queue[head & MULTI_QUEUE_MASK] = data;
+  g_multi_channel[head & MULTI_QUEUE_MASK] = channel;
+  g_multi_status[head & MULTI_QUEUE_MASK] = status;
+
+  //
+  //  Publish the byte only after it has been written.
+  //
+  g_multi_head = head + 1;
+}
+
+//*****************************************************************************
+//
+//  Interrupt Service Routines
+//
+//*****************************************************************************
+//*****************************************************************************
+//
+//! @brief Output Compare A ISR, samples every channel of the port.
+//!
+//! The TSOP output is low during a burst, so a falling edge starts a burst.
+//! The interval counters of all channels are increased with one ripple carry
+//! over the planes, saturating at 31. Most samples end there, about 60
+//! cycles out of the 1696 of each sample period; a sample with bursts runs
+//! decode_bursts() once for all of them.
+//!
+//! @return None.
+//
+//*****************************************************************************
+ISR (TIMER2_COMPA_vect)
+{
+  uint8_t i;
+  uint8_t tmp;
+  uint8_t carry;
+  uint8_t level = ~MULTI_PIN & MULTI_CHANNEL_MASK;
+  uint8_t fall = level & ~g_last_level;
+
+  g_last_level = level;
+
+  carry = ~(g_interval[0] & g_interval[1] & g_interval[2] &
+            g_interval[3] & g_interval[4]);
+  for (i = 0; i < INTERVAL_PLANES; i++)
+  {
+    tmp = g_interval[i] & carry;
+    g_interval[i] ^= carry;
+    carry = tmp;
+  }
+
+  if (fall)
+  {
+    decode_bursts(fall);
+  }
+}
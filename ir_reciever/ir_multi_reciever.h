@@ -0,0 +1,31 @@
+//*****************************************************************************
+//
+//  Prototypes for the multi IR Sensor engine.
+//  File:     ir_multi_reciever.h
+//  Version:  1.0v
+//  Author:   Ronald Rodriguez Ruiz.
+//  ---------------------------------------------------------------------------
+//  Specifications:
+//  Runs on 8-bit AVR Microcontrollers (ATmega series).
+//  Up to eight IR Sensors share one port, each one has to operate in a
+//  frequency of 33 Khz. It is recommended to implement the Vishay TSOP Series
+//  33 kHz Infrared Receivers.
+//  Standalone module, it is not started by IR_Reciever_init().
+//
+//*****************************************************************************
+
+#ifndef __MULTI_RECIEVER_H__
+#define __MULTI_RECIEVER_H__
+
+//*****************************************************************************
+//
+//  Prototypes for the API
+//
+//*****************************************************************************
+
+extern void IR_Multi_Reciever_init(void);
+extern uint8_t IR_multi_available(void);
+extern uint8_t IR_multi_read(uint8_t* channel, uint8_t* status);
+extern uint8_t IR_multi_get_overruns(void);
+
+#endif
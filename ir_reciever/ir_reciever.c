@@ -10,13 +10,24 @@
 //  Runs on 8-bit AVR Microcontrollers (ATmega series).
 //  The IR Sensor has to operate in a frequency of 33 Khz. It is recommended
 //  to implement the Vishay TSOP Series 33 kHz Infrared Receivers.
+//  IrDA SIR transmissions (9600 baud) are detected by their short pulses and
+//  decoded as well, which requires an IrDA transceiver on the same input.
+//  Build with IR_FAST_CAPTURE defined to replace the capture ISR with the
+//  assembly one, which uses GPIOR0 and GPIOR1. Its edges are processed by
+//  IR_process(), which must then run at least every 2 ms.
+//  Build with IR_OVERSAMPLING defined to include the oversampling engine,
+//  which takes the TIMER0 and its Compare A ISR. The emitter uses them too,
+//  so a firmware with both leaves it undefined.
 //
 //*****************************************************************************
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <avr/eeprom.h>
 #include "ir_reciever.h"
 #include "bitwiseop.h"
 
@@ -38,27 +49,189 @@
 #define EVENT_BUFFER_SIZE             30
 
 //
-//  The data size may vary depend on the program that the calculator is
-//  using to transmit the data.
+//  Each event is stored as a 2-bit pulse symbol, four symbols per byte.
 //
-#define DATA_BUFFER_SIZE              12
+#define SYMBOL_BUFFER_SIZE            ((EVENT_BUFFER_SIZE + 3) / 4)
+
+//
+//  Number of event buffers (frames) the capture can run ahead of the
+//  decoder, two buffers give a ping-pong scheme.
+//
+#define EVENT_SLOTS                   2
+
+//
+//  Size of the ring where the fast capture ISR (IR_FAST_CAPTURE) queues the
+//  edges for capture_event(). It must be a power of two.
+//
+#define CAPTURE_EDGES                 8
+
+//
+//  Size of the queue that holds the decoded bytes until the user reads them.
+//  It must be a power of two, so the free running indices wrap with a mask.
+//
+#define RX_QUEUE_SIZE                 32
+#define RX_QUEUE_MASK                 (RX_QUEUE_SIZE - 1)
+
+//
+//  Size of the queue that holds the length of each complete transmission,
+//  also a power of two.
+//
+#define TRANSMISSION_QUEUE_SIZE       4
+#define TRANSMISSION_QUEUE_MASK       (TRANSMISSION_QUEUE_SIZE - 1)
+
+//
+//  Default silence that ends a transmission, in timer ticks (2500 * 4 us =
+//  10 ms). It must be longer than the gap between two frames of one
+//  transmission.
+//
+#define TRANSMISSION_GAP              2500
+
+//
+//  Default silence after IR_Reciever_resume() before the capture is enabled
+//  again, in timer ticks (250 * 4 us = 1 ms). The guard must be at least
+//  MIN_GUARD_TIME so the compare match is not set behind the counter.
+//
+#define GUARD_TIME                    250
+#define MIN_GUARD_TIME                4
+
+//
+//  Version of the timing profile stored in the EEPROM, an erased EEPROM
+//  (0xFF) or a profile with another layout is ignored.
+//
+#define PROFILE_VERSION               0x01
+
+//*****************************************************************************
+//
+//  The following are defines for the quarter of bit positions within one
+//  frame sent by the calculator HP 48GX. The frame is counted in quarters of
+//  bit from the first falling edge: the three opening half bits take 6
+//  quarters, then each of the 12 bits (4 error bits and 8 data bits, MSB
+//  first) takes 4 quarters. A bit is 1 when its first quarter is a burst.
+//
+//*****************************************************************************
+
+#define START_BITS_QUARTERS           6
+#define QUARTERS_PER_BIT              4
+#define FIRST_BIT_POS                 START_BITS_QUARTERS
+#define LAST_BIT_POS                  (FIRST_BIT_POS + 11 * QUARTERS_PER_BIT)
+
+//
+//  Sentinel in the syndrome table for errors that cannot be corrected.
+//
+#define UNCORRECTABLE                 0xFF
+
+//*****************************************************************************
+//
+//  The following are defines for the pulse width windows in timer ticks
+//  (4 us). The nominal windows, tuned with the IR sensor TSOP 1733, are the
+//  defaults of the timing profile, used for the opening half bits of each
+//  frame. The first CLOCK_RECOVERY_PULSES
+//  pulses span exactly two half bits (4 quarters), so their sum gives the
+//  bit clock of the frame and the windows for the rest of it.
+//
+//*****************************************************************************
+
+#define NOMINAL_MIN_WIDTH             20
+#define NOMINAL_ONE_QUARTER_MAX       100
+#define NOMINAL_THREE_QUARTERS_MAX    200
+#define NOMINAL_FIVE_QUARTERS_MAX     300
+#define CLOCK_RECOVERY_PULSES         4
+
+//*****************************************************************************
+//
+//  The following are defines for the oversampling engine. The TIMER0 samples
+//  the IR sensor (ICP1 pin) every 18 ticks of 4 us = 72 us, 3 samples per
+//  quarter of bit, and the line level is the majority of the last 3 samples.
+//  Bit n of MAJORITY_VOTES is the vote of the 3 samples n. The vote changes
+//  1.5 samples after the edge on average, EDGE_DELAY in TIMER1 ticks.
+//
+//*****************************************************************************
+
+#define SAMPLE_PERIOD_TICKS           18
+#define MAJORITY_VOTES                0xE8
+#define EDGE_DELAY                    27
+
+//*****************************************************************************
+//
+//  The following are defines for the IrDA SIR protocol at 9600 baud, in
+//  timer ticks (4 us). Each byte is sent LSB first between a start bit and a
+//  stop bit, and every 0 bit (the start bit too) is a pulse of 3/16 of bit
+//  (19.5 us), far shorter than any "red eye" burst. A transmission is taken
+//  as SIR when its first two pulses are shorter than SIR_MAX_PULSE with a
+//  silence between them, which a glitch within a burst never gives.
+//
+//*****************************************************************************
+
+#define SIR_MAX_PULSE                 12
+#define SIR_BIT_TICKS                 26
+
+//
+//  A pulse 9.5 bits or more after the start bit is the next start bit.
+//
+#define SIR_BYTE_TICKS                ((SIR_BIT_TICKS * 19) / 2)
+
+//
+//  Bit position of a pulse, rounded: (ticks * 5 + 64) >> 7 is ticks / 25.6,
+//  close enough to 26.04 ticks per bit over 9 bits without a division.
+//
+#define SIR_BIT_SCALE                 5
+#define SIR_BIT_SHIFT                 7
+#define SIR_BIT_ROUNDING              (1 << (SIR_BIT_SHIFT - 1))
+
+//*****************************************************************************
+//
+//  The following are enumerations for the pulse symbols. The ISR classifies
+//  every pulse by its width, a valid symbol has (2 * symbol - 1) quarters of
+//  bit.
+//
+//*****************************************************************************
+
+enum Pulse_Symbol
+{
+  SYMBOL_INVALID,
+  SYMBOL_ONE_QUARTER,
+  SYMBOL_THREE_QUARTERS,
+  SYMBOL_FIVE_QUARTERS
+};
+
+//*****************************************************************************
+//
+//  The following arrays hold the "red eye" Hamming code. Each error bit is
+//  the parity of the data bits selected by its mask, first error bit sent
+//  first. For every syndrome (received error bits XOR computed ones) the
+//  second array holds the data bit to flip: 0x00 if the error hit an error
+//  bit, UNCORRECTABLE if more than one bit was hit.
+//
+//*****************************************************************************
+
+static const uint8_t g_error_masks[] =
+{
+  0x78, 0xE6, 0xD5, 0x8B
+};
+
+static const uint8_t g_syndrome_corrections[] =
+{
+  0x00, 0x00, 0x00, 0x01,
+  0x00, 0x02, 0x04, 0x80,
+  0x00, 0x08, 0x10, UNCORRECTABLE,
+  0x20, UNCORRECTABLE, 0x40, UNCORRECTABLE
+};
 
 //*****************************************************************************
 //
-//  The following are defines for bit position in one data byte
-//  sent by the calculator HP 48GX (these bit positions is defined based on
-//  on the decodification of one data frame using the IR sensor TSOP 1733).
+//  The following structure is the layout of the timing profile in the
+//  EEPROM, the checksum is the sum of the profile bytes.
 //
 //*****************************************************************************
 
-#define FIRST_BIT_POS                 51
-#define SECOND_BIT_POS                47
-#define THIRD_BIT_POS                 43
-#define FOURTH_BIT_POS                39
-#define FIFTH_BIT_POS                 35
-#define SIXTH_BIT_POS                 31
-#define SEVENTH_BIT_POS               27
-#define EIGHTH_BIT_POS                23
+struct Profile_Record
+{
+  uint8_t version;
+  struct IR_Profile profile;
+  uint8_t checksum;
+};
+
+static struct Profile_Record EEMEM g_eeprom_profile;
 
 //*****************************************************************************
 //
@@ -67,14 +240,165 @@
 //
 //*****************************************************************************
 
-static uint64_t g_last_event;
-static volatile uint8_t g_byte_cnt;
-static volatile uint64_t g_virtual_cnt;
-static volatile bool g_is_edge_falling;
-static volatile bool g_is_event_buffer_full;
-static volatile uint8_t g_event_buffer_index;
-static uint8_t  g_data_buffer[DATA_BUFFER_SIZE];
-static volatile uint64_t g_event_buffer[EVENT_BUFFER_SIZE];
+static uint16_t g_last_capture;
+static volatile uint8_t g_frame_drops;
+
+#ifdef IR_FAST_CAPTURE
+//
+//  Edges queued by the fast capture ISR: the capture time and the TCCR1B
+//  value at the capture, which holds the polarity of the edge. The entries
+//  take 4 bytes so the ISR indexes them with two shifts. GPIOR0 is the head
+//  of the ring, written by the ISR, and GPIOR1 the tail.
+//
+struct Capture_Edge
+{
+  uint16_t timer_value;
+  uint8_t control;
+  uint8_t padding;
+};
+
+static volatile struct Capture_Edge g_capture_edges[CAPTURE_EDGES];
+#endif
+
+//
+//  Engine in use (IR_Engine). The oversampling engine keeps the last
+//  samples in g_samples and the voted line level in g_line_level.
+//
+static uint8_t g_engine;
+#ifdef IR_OVERSAMPLING
+static uint8_t g_samples;
+static bool g_line_level;
+#endif
+
+//
+//  Statistics. The ISRs only update the edge and resync counters, the rest
+//  of g_stats is only written by the decoder.
+//
+static volatile uint16_t g_edge_cnt;
+static volatile uint16_t g_glitches;
+static volatile uint8_t g_resyncs;
+static struct IR_Stats g_stats;
+
+//
+//  Time stamps. The TIMER1 overflows extend the 16-bit captures to 32 bits.
+//  The capture ISR stamps the first edge of each transmission and both
+//  edges are handed to the decoder with the last slot of the transmission.
+//
+static volatile uint16_t g_timer_overflows;
+static uint32_t g_capture_first_edge;
+static volatile uint32_t g_slot_first_edge[EVENT_SLOTS];
+static volatile uint32_t g_slot_last_edge[EVENT_SLOTS];
+
+//
+//  Event flag set by the ISRs whenever they leave work for the decoder, and
+//  cleared by the decoder before it starts.
+//
+static volatile bool g_is_decode_pending;
+
+//
+//  Timing profile in use, read by the ISRs. g_slot_clock holds the bit
+//  clock recovered for the frame of each slot and g_calibration_clock the
+//  one of the last frame decoded without errors.
+//
+static struct IR_Profile g_profile;
+static volatile uint16_t g_slot_clock[EVENT_SLOTS];
+static uint16_t g_calibration_clock;
+
+//
+//  Pulse width windows of the frame being captured, only used by the ISR.
+//  g_clock_ticks accumulates the opening pulses.
+//
+static uint16_t g_clock_ticks;
+static uint16_t g_min_width;
+static uint16_t g_one_quarter_max;
+static uint16_t g_three_quarters_max;
+static uint16_t g_five_quarters_max;
+
+//
+//  Event buffers. The ISR fills g_capture_slot and flips to the next slot
+//  once the frame is complete; the decoder reads g_decode_slot and releases
+//  it by clearing g_is_slot_full, so a slot is never written while it still
+//  holds events that were not decoded.
+//
+static uint8_t g_capture_slot;
+static uint8_t g_event_buffer_index;
+static bool g_is_frame_dropped;
+
+//
+//  Glitch filter, only used by the ISRs. g_pending_width holds the last
+//  pulse until the next one shows it was not split by a glitch, except the
+//  last pulse of a frame, and g_sir_silence the silence after a first pulse
+//  that may be a SIR start bit.
+//
+static uint16_t g_pending_width;
+static bool g_is_pulse_pending;
+static bool g_is_merging;
+static uint16_t g_sir_silence;
+static volatile uint8_t g_event_cnt[EVENT_SLOTS];
+static volatile bool g_is_slot_full[EVENT_SLOTS];
+static volatile bool g_is_slot_last[EVENT_SLOTS];
+static volatile bool g_is_slot_sir[EVENT_SLOTS];
+static volatile uint8_t g_symbol_buffer[EVENT_SLOTS][SYMBOL_BUFFER_SIZE];
+
+//
+//  IrDA SIR capture. Once a transmission is detected as SIR, the ISR decodes
+//  its bytes and stores them whole in the event buffers, one byte per
+//  position from position 1 on.
+//
+static bool g_is_sir;
+static uint8_t g_sir_data;
+static uint16_t g_sir_byte_start;
+
+//
+//  Single-producer/single-consumer queue of decoded bytes. The decoder only
+//  writes g_rx_head and the user only writes g_rx_tail, both are single
+//  bytes so they are read atomically without masking interrupts.
+//
+static volatile uint8_t g_rx_head;
+static volatile uint8_t g_rx_tail;
+static volatile uint8_t g_rx_overruns;
+static uint8_t g_rx_queue[RX_QUEUE_SIZE];
+static uint8_t g_rx_status[RX_QUEUE_SIZE];
+
+//
+//  Queue with the length of every complete transmission, same ownership
+//  rules as the byte queue. g_transmission_length counts the bytes queued
+//  for the transmission in progress.
+//
+static uint8_t g_transmission_length;
+static volatile uint8_t g_transmission_head;
+static volatile uint8_t g_transmission_tail;
+static uint8_t g_transmission_queue[TRANSMISSION_QUEUE_SIZE];
+static uint32_t g_transmission_first_edge[TRANSMISSION_QUEUE_SIZE];
+static uint32_t g_transmission_last_edge[TRANSMISSION_QUEUE_SIZE];
+
+//
+//  Time stamps of the last transmission handed to the user. The first edge
+//  of a transmission merged with the next one is kept meanwhile.
+//
+static struct IR_Timestamps g_timestamps;
+static uint32_t g_merged_first_edge;
+static bool g_is_transmission_merged;
+
+//
+//  State of the frame decoder, advanced once per captured event.
+//
+static uint8_t g_decode_slot;
+static uint8_t g_decode_index;
+static uint8_t g_quarter_cnt;
+static uint8_t g_bit_position;
+static uint16_t g_codeword;
+static bool g_is_burst;
+static bool g_is_frame_valid;
+
+//
+//  Handlers registered by the user, called by the decoder. g_reported_drops
+//  follows g_frame_drops to report the frames dropped by the ISR.
+//
+static IR_Byte_Handler g_byte_handler;
+static IR_Transmission_Handler g_transmission_handler;
+static IR_Error_Handler g_error_handler;
+static uint8_t g_reported_drops;
 
 //*****************************************************************************
 //
@@ -83,9 +407,37 @@ static volatile uint64_t g_event_buffer[EVENT_BUFFER_SIZE];
 //*****************************************************************************
 
 static void TIMER1_init(void);
-static void update_data_buffer(void);
-static void write_bit(uint8_t bit, bool logic_level);
-static void find_bit_position(uint8_t bit_position, bool logic_level);
+#ifdef IR_OVERSAMPLING
+static void TIMER0_init(void);
+#endif
+static void decode_pending_events(void);
+static void decode_event(uint8_t index, uint8_t symbol);
+static void decode_sir_byte(uint8_t slot, uint8_t index);
+static uint8_t read_symbol(uint8_t slot, uint8_t index);
+static uint8_t get_parity(uint8_t value);
+static void rx_queue_put(uint8_t data, uint8_t status);
+static void end_transmission(void);
+static inline void close_capture_slot(bool is_last);
+static inline void end_capture_frame(void);
+static inline uint8_t get_pulse_symbol(uint16_t pulse_width);
+static inline void set_pulse_windows(uint16_t clock_ticks);
+static inline uint16_t read_timer(void);
+static void report_error(uint8_t error);
+static inline void end_capture_transmission(uint16_t timer_value);
+static inline uint32_t get_timestamp(uint16_t timer_value);
+static inline bool is_sir_start(uint16_t pulse_width);
+static inline void start_sir(uint16_t byte_start);
+static inline void capture_sir_pulse(uint16_t timer_value);
+static inline void store_sir_byte(void);
+static inline void capture_event(uint16_t timer_value, bool is_rising_edge);
+static inline void store_pulse(uint16_t pulse_width);
+static inline void flush_pending_pulse(void);
+#ifdef IR_FAST_CAPTURE
+static bool drain_capture_edges(void);
+#endif
+static bool load_profile(void);
+static bool is_profile_valid(const struct IR_Profile* profile);
+static uint8_t get_checksum(const struct IR_Profile* profile);
 
 //*****************************************************************************
 //
@@ -94,269 +446,1902 @@ static void find_bit_position(uint8_t bit_position, bool logic_level);
 //*****************************************************************************
 //*****************************************************************************
 //
-//! @brief Initialize the software and hardware resources of the application.
+//! @brief Initialize the software and hardware resources of the application.
+//!
+//! Both engines feed the same decoder. The input capture engine times each
+//! edge with the TIMER1, the oversampling engine filters short glitches by
+//! majority vote at the cost of a periodic TIMER0 interrupt. The latter is
+//! only built with IR_OVERSAMPLING, otherwise the input capture engine is
+//! used whatever the engine requested.
+//!
+//! @param[in] engine IR_ENGINE_CAPTURE or IR_ENGINE_OVERSAMPLING.
+//!
+//! @return None.
+//
+//*****************************************************************************
+void
+IR_Reciever_init(uint8_t engine)
+{
+  g_rx_head = 0;
+  g_rx_tail = 0;
+  g_rx_overruns = 0;
+  g_transmission_head = 0;
+  g_transmission_tail = 0;
+  g_transmission_length = 0;
+  g_frame_drops = 0;
+  g_last_capture = 0;
+  g_edge_cnt = 0;
+  g_glitches = 0;
+  g_resyncs = 0;
+  g_pending_width = 0;
+  g_is_pulse_pending = false;
+  g_is_merging = false;
+  g_sir_silence = 0;
+#ifdef IR_FAST_CAPTURE
+  GPIOR0 = 0;
+  GPIOR1 = 0;
+#endif
+  g_timer_overflows = 0;
+  g_is_transmission_merged = false;
+  g_timestamps = (struct IR_Timestamps){ 0 };
+  g_stats = (struct IR_Stats){ 0 };
+  g_is_decode_pending = false;
+  g_decode_slot = 0;
+  g_decode_index = 0;
+  g_capture_slot = 0;
+  g_event_buffer_index = 0;
+  g_is_frame_valid = false;
+  g_is_frame_dropped = false;
+  g_is_sir = false;
+  g_byte_handler = NULL;
+  g_transmission_handler = NULL;
+  g_error_handler = NULL;
+  g_reported_drops = 0;
+  g_calibration_clock = 0;
+
+  //
+  //  Load the timing profile saved in the EEPROM, or the defaults if there
+  //  is none.
+  //
+  if (!load_profile())
+  {
+    g_profile.min_width = NOMINAL_MIN_WIDTH;
+    g_profile.one_quarter_max = NOMINAL_ONE_QUARTER_MAX;
+    g_profile.three_quarters_max = NOMINAL_THREE_QUARTERS_MAX;
+    g_profile.five_quarters_max = NOMINAL_FIVE_QUARTERS_MAX;
+    g_profile.transmission_gap = TRANSMISSION_GAP;
+    g_profile.guard_time = GUARD_TIME;
+  }
+  g_five_quarters_max = g_profile.five_quarters_max;
+
+  for (uint8_t i = 0; i < EVENT_SLOTS; i++)
+  {
+    g_event_cnt[i] = 0;
+    g_is_slot_full[i] = false;
+    g_is_slot_last[i] = false;
+    g_is_slot_sir[i] = false;
+  }
+
+  //
+  //  The TIMER1 is the time base of both engines.
+  //
+  TIMER1_init();
+
+#ifdef IR_OVERSAMPLING
+  g_engine = engine;
+  if (g_engine == IR_ENGINE_OVERSAMPLING)
+  {
+    _clear_bit(TIMSK1, ICIE1);
+    TIMER0_init();
+  }
+#else
+  (void)engine;
+  g_engine = IR_ENGINE_CAPTURE;
+#endif
+}
+
+//*****************************************************************************
+//
+//! @brief Stops the capture of events, e.g. while the local IR LED is on.
+//!
+//! Meant to be called by the emitter before it sends a request, so the
+//! echo of its own bursts is never captured. A transmission in progress
+//! ends right away, a frame still open is handed to the decoder as it is.
+//!
+//! @return None.
+//
+//*****************************************************************************
+void
+IR_Reciever_suspend(void)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    _clear_two_bits(TIMSK1, ICIE1, OCIE1B);
+
+#ifdef IR_OVERSAMPLING
+    //
+    //  The TIMER0 only belongs to the reciever with the oversampling
+    //  engine, the emitter times its levels with it.
+    //
+    if (g_engine == IR_ENGINE_OVERSAMPLING)
+    {
+      _clear_bit(TIMSK0, OCIE0A);
+    }
+#endif
+
+    if (_read_bit(TIMSK1, OCIE1A))
+    {
+      _clear_bit(TIMSK1, OCIE1A);
+      end_capture_transmission(TCNT1);
+    }
+  }
+}
+
+//*****************************************************************************
+//
+//! @brief Enables the capture of events again after the guard time.
+//!
+//! Meant to be called by the emitter once the request has been sent. The
+//! Output Compare B ISR enables the capture once the guard time has elapsed,
+//! which leaves the IR sensor time to recover from the local bursts.
+//!
+//! @return None.
+//
+//*****************************************************************************
+void
+IR_Reciever_resume(void)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    OCR1B = TCNT1 + g_profile.guard_time;
+    _set_bit(TIFR1, OCF1B);
+    _set_bit(TIMSK1, OCIE1B);
+  }
+}
+
+//*****************************************************************************
+//
+//! @brief Sets the guard time applied by IR_Reciever_resume().
+//!
+//! @param[in] guard_time Silence in timer ticks (4 us), GUARD_TIME by
+//! default. Values under MIN_GUARD_TIME are raised to it.
+//!
+//! @return None.
+//
+//*****************************************************************************
+void
+IR_Reciever_set_guard_time(uint16_t guard_time)
+{
+  if (guard_time < MIN_GUARD_TIME)
+  {
+    guard_time = MIN_GUARD_TIME;
+  }
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    g_profile.guard_time = guard_time;
+  }
+}
+
+//*****************************************************************************
+//
+//! @brief Copies the timing profile in use.
+//!
+//! @param[out] profile Timing profile.
+//!
+//! @return None.
+//
+//*****************************************************************************
+void
+IR_get_profile(struct IR_Profile* profile)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    *profile = g_profile;
+  }
+}
+
+//*****************************************************************************
+//
+//! @brief Replaces the timing profile in use, it is not saved.
+//!
+//! The windows must be increasing and shorter than the transmission gap.
+//!
+//! @param[in] profile New timing profile.
+//!
+//! @return True if the profile is valid and was applied.
+//
+//*****************************************************************************
+bool
+IR_set_profile(const struct IR_Profile* profile)
+{
+  if (!is_profile_valid(profile))
+  {
+    return false;
+  }
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    g_profile = *profile;
+  }
+
+  return true;
+}
+
+//*****************************************************************************
+//
+//! @brief Derives the nominal windows from the last frame decoded without
+//! errors.
+//!
+//! The windows are centered on the bit clock recovered for that frame, the
+//! same way the ISR does within each frame, so the opening half bits of the
+//! next frames are classified for the sensor actually fitted. Meant to be
+//! called after a known transmission was recieved, then IR_save_profile()
+//! keeps the result.
+//!
+//! @return True if a frame was available and the profile was applied.
+//
+//*****************************************************************************
+bool
+IR_calibrate(void)
+{
+  struct IR_Profile profile;
+  uint16_t clock_ticks = g_calibration_clock;
+
+  if (clock_ticks == 0)
+  {
+    return false;
+  }
+
+  IR_get_profile(&profile);
+  profile.min_width = clock_ticks >> 3;
+  profile.one_quarter_max = clock_ticks >> 1;
+  profile.three_quarters_max = clock_ticks;
+  profile.five_quarters_max = clock_ticks + (clock_ticks >> 1);
+
+  return IR_set_profile(&profile);
+}
+
+//*****************************************************************************
+//
+//! @brief Saves the timing profile in use into the EEPROM.
+//!
+//! Only the bytes that changed are written, so saving the same profile again
+//! does not wear the EEPROM. IR_Reciever_init() loads it at the next start.
+//!
+//! @return None.
+//
+//*****************************************************************************
+void
+IR_save_profile(void)
+{
+  struct Profile_Record record;
+
+  record.version = PROFILE_VERSION;
+  IR_get_profile(&record.profile);
+  record.checksum = get_checksum(&record.profile);
+
+  eeprom_update_block(&record, &g_eeprom_profile, sizeof(record));
+}
+
+//*****************************************************************************
+//
+//! @brief Decodes the pending events and calls the registered handlers.
+//!
+//! Meant for applications that use the handlers instead of IR_available()
+//! and IR_get_transmission(), it must be called from the main loop whenever
+//! IR_has_pending_events() is true. The handlers run in this context, never
+//! in an ISR.
+//!
+//! @return None.
+//
+//*****************************************************************************
+void
+IR_process(void)
+{
+  decode_pending_events();
+}
+
+//*****************************************************************************
+//
+//! @brief Registers the handler called for every decoded byte.
+//!
+//! While only this handler is set, the bytes are delivered through it and
+//! not queued. If a transmission handler is also set, both get the bytes.
+//!
+//! @param[in] handler Function called with the byte and its status, NULL to
+//! go back to the queue.
+//!
+//! @return None.
+//
+//*****************************************************************************
+void
+IR_on_byte(IR_Byte_Handler handler)
+{
+  g_byte_handler = handler;
+}
+
+//*****************************************************************************
+//
+//! @brief Registers the handler called for every complete transmission.
+//!
+//! The bytes and their status are passed in place, straight from the queue,
+//! and released once the handler returns. To keep them contiguous the queue
+//! is rewound after each transmission, so IR_get_transmission() and
+//! IR_read() must not be used while the handler is set. The bytes already
+//! queued are discarded.
+//!
+//! @param[in] handler Function called with the bytes, their status and the
+//! length of the transmission, NULL to go back to the queue.
+//!
+//! @return None.
+//
+//*****************************************************************************
+void
+IR_on_transmission(IR_Transmission_Handler handler)
+{
+  g_transmission_handler = handler;
+
+  g_rx_head = 0;
+  g_rx_tail = 0;
+  g_transmission_length = 0;
+  g_transmission_tail = g_transmission_head;
+}
+
+//*****************************************************************************
+//
+//! @brief Registers the handler called for every error of the reciever.
+//!
+//! @param[in] handler Function called with the error (IR_Error), NULL to
+//! disable it.
+//!
+//! @return None.
+//
+//*****************************************************************************
+void
+IR_on_error(IR_Error_Handler handler)
+{
+  g_error_handler = handler;
+}
+
+//*****************************************************************************
+//
+//! @brief Returns the number of decoded bytes waiting to be read.
+//!
+//! This function feeds every event captured since the last call to the frame
+//! decoder, so each byte is queued as soon as its last event arrives.
+//!
+//! @return Number of bytes available through IR_read().
+//
+//*****************************************************************************
+uint8_t
+IR_available(void)
+{
+  decode_pending_events();
+
+  return (uint8_t)(g_rx_head - g_rx_tail);
+}
+
+//*****************************************************************************
+//
+//! @brief Indicates if the reciever has pending work or data for the user.
+//!
+//! Meant to be called with interrupts disabled right before entering sleep
+//! mode: if it returns false, nothing will change until the next interrupt
+//! (input capture, transmission timeout), which also wakes the MCU up.
+//!
+//! @return True if IR_get_transmission() or IR_available() must be called.
+//
+//*****************************************************************************
+bool
+IR_has_pending_events(void)
+{
+#ifdef IR_FAST_CAPTURE
+  if (GPIOR0 != GPIOR1)
+  {
+    return true;
+  }
+#endif
+  return g_is_decode_pending || (g_transmission_tail != g_transmission_head);
+}
+
+//*****************************************************************************
+//
+//! @brief Returns the length of the oldest complete transmission.
+//!
+//! A transmission ends after the transmission gap of the timing profile,
+//! whatever number of bytes it had. The returned number of bytes must then
+//! be read through IR_read().
+//!
+//! @return length Bytes in the transmission, 0 if none is complete.
+//
+//*****************************************************************************
+uint8_t
+IR_get_transmission(void)
+{
+  uint8_t length = 0;
+  uint8_t tail;
+
+  decode_pending_events();
+
+  tail = g_transmission_tail;
+  if (tail != g_transmission_head)
+  {
+    length = g_transmission_queue[tail & TRANSMISSION_QUEUE_MASK];
+    g_timestamps.first_edge =
+      g_transmission_first_edge[tail & TRANSMISSION_QUEUE_MASK];
+    g_timestamps.last_edge =
+      g_transmission_last_edge[tail & TRANSMISSION_QUEUE_MASK];
+    g_timestamps.delivery = IR_get_time();
+    g_transmission_tail = tail + 1;
+  }
+
+  return length;
+}
+
+//*****************************************************************************
+//
+//! @brief Copies the time stamps of the last transmission handed to the
+//! user, by IR_get_transmission() or by the transmission handler.
+//!
+//! @param[out] timestamps Time stamps in timer ticks (4 us), on the same
+//! time base as IR_get_time().
+//!
+//! @return None.
+//
+//*****************************************************************************
+void
+IR_get_timestamps(struct IR_Timestamps* timestamps)
+{
+  *timestamps = g_timestamps;
+}
+
+//*****************************************************************************
+//
+//! @brief Returns the time since the initialization.
+//!
+//! @return Time in timer ticks (4 us), it wraps around after 4.7 hours.
+//
+//*****************************************************************************
+uint32_t
+IR_get_time(void)
+{
+  uint32_t timestamp;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    timestamp = get_timestamp(TCNT1);
+  }
+
+  return timestamp;
+}
+
+//*****************************************************************************
+//
+//! @brief Reads the oldest decoded byte.
+//!
+//! @note IR_available() must be checked first, reading an empty queue
+//! returns 0.
+//!
+//! @param[out] status Error bits check of the byte (IR_Byte_Status), it can
+//! be NULL if not needed.
+//!
+//! @return data Decoded byte.
+//
+//*****************************************************************************
+uint8_t
+IR_read(uint8_t* status)
+{
+  uint8_t data = 0;
+  uint8_t tail = g_rx_tail;
+
+  if (tail != g_rx_head)
+  {
+    data = g_rx_queue[tail & RX_QUEUE_MASK];
+    if (status)
+    {
+      *status = g_rx_status[tail & RX_QUEUE_MASK];
+    }
+
+    //
+    //  Release the slot only after the byte has been copied.
+    //
+    g_rx_tail = tail + 1;
+  }
+
+  return data;
+}
+
+//*****************************************************************************
+//
+//! @brief Returns how many decoded bytes were lost because the queue was
+//! full.
+//!
+//! @return Number of overruns since the initialization.
+//
+//*****************************************************************************
+uint8_t
+IR_get_overruns(void)
+{
+  return g_rx_overruns;
+}
+
+//*****************************************************************************
+//
+//! @brief Returns how many frames were not captured because every event
+//! buffer was still waiting to be decoded.
+//!
+//! @return Number of dropped frames since the initialization.
+//
+//*****************************************************************************
+uint8_t
+IR_get_frame_drops(void)
+{
+  return g_frame_drops;
+}
+
+//*****************************************************************************
+//
+//! @brief Copies the counters of the reciever.
+//!
+//! Only the counters updated by the ISRs are read with the interrupts
+//! disabled, the rest belong to the decoder, which runs in this context.
+//!
+//! @param[out] stats Counters since the initialization.
+//!
+//! @return None.
+//
+//*****************************************************************************
+void
+IR_get_stats(struct IR_Stats* stats)
+{
+  *stats = g_stats;
+  stats->overruns = g_rx_overruns;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    stats->edges = g_edge_cnt;
+    stats->glitches = g_glitches;
+    stats->resyncs = g_resyncs;
+    stats->frame_drops = g_frame_drops;
+  }
+}
+
+//*****************************************************************************
+//
+//! @brief Checks the error bits of one frame and corrects the data byte.
+//!
+//! The codeword holds the 4 error bits (bits 11-8) followed by the 8 data
+//! bits (bits 7-0). Any single bit error is corrected, either in the data or
+//! in the error bits. Shared with the multi sensor engine.
+//!
+//! @param[in] codeword The 12 bits sampled from the frame.
+//! @param[out] data Data byte, corrected if possible.
+//!
+//! @return status IR_BYTE_OK, IR_BYTE_CORRECTED or IR_BYTE_UNCORRECTABLE.
+//
+//*****************************************************************************
+uint8_t
+IR_check_codeword(uint16_t codeword, uint8_t* data)
+{
+  uint8_t i;
+  uint8_t correction;
+  uint8_t syndrome = (uint8_t)(codeword >> 8);
+
+  *data = (uint8_t)codeword;
+
+  //
+  //  Compare the received error bits with the ones computed from the data.
+  //
+  for (i = 0; i < sizeof(g_error_masks); i++)
+  {
+    syndrome ^= get_parity(*data & g_error_masks[i]) << (3 - i);
+  }
+
+  if (syndrome == 0)
+  {
+    return IR_BYTE_OK;
+  }
+
+  correction = g_syndrome_corrections[syndrome];
+  if (correction == UNCORRECTABLE)
+  {
+    return IR_BYTE_UNCORRECTABLE;
+  }
+
+  *data ^= correction;
+
+  return IR_BYTE_CORRECTED;
+}
+
+//*****************************************************************************
+//
+//  Private Functions.
+//
+//*****************************************************************************
+//*****************************************************************************
+//
+//! @brief Initialize the TIMER1 in Input Capture Mode.
+//!
+//! This function resets and configures the TIMER1 registers to operate in
+//! Input Capture Mode. The TIMER1 runs with a prescaler of 64 (4 us per tick
+//! at 16 MHz), so a 16-bit difference between two captures spans 262 ms,
+//! which is far longer than any pulse within a frame. The Input Capture ISR
+//! at a falling edge and the Output Compare A ISR (transmission timeout) are
+//! set. The Overflow ISR only extends the time stamps to 32 bits.
+//!
+//! @return None.
+//
+//*****************************************************************************
+static void
+TIMER1_init(void)
+{
+  //
+  //  Clear the TIMER1 registers.
+  //
+  TCCR1A = 0x00;
+  TCCR1C = 0x00;
+
+  //
+  //  Input Capture Mode Setup.
+  //  CS11 - CS10: Prescale 64 (4 us per tick).
+  //  ICNC1: Enable Input Capture Noise Canceler.
+  //  ICES1: Capture Falling Edge.
+  //
+  _set_bit(TCCR1B, ICNC1);
+  _set_two_bits(TCCR1B, CS11, CS10);
+  _clear_bit(TCCR1B, ICES1);
+
+  //
+  //  Interrupt Service Routines Setup.
+  //  ICIE1: Input Capture.
+  //  OCIE1A: Output Compare A, armed by each event to detect the end of
+  //  the transmission.
+  //  OCIE1B: Output Compare B, armed by IR_Reciever_resume() for the guard
+  //  time.
+  //  TOIE1: Overflow, for the time stamps.
+  //
+  _set_two_bits(TIFR1, ICF1, OCF1A);
+  _set_bit(TIFR1, TOV1);
+  _clear_two_bits(TIMSK1, OCIE1A, OCIE1B);
+  _set_two_bits(TIMSK1, ICIE1, TOIE1);
+}
+
+#ifdef IR_OVERSAMPLING
+//*****************************************************************************
+//
+//! @brief Initialize the TIMER0 in CTC Mode for the oversampling engine.
+//!
+//! The TIMER0 runs with a prescaler of 64 (4 us per tick at 16 MHz) and
+//! clears on OCR0A, so the Output Compare A ISR samples the IR sensor every
+//! SAMPLE_PERIOD_TICKS. The line starts idle (high).
+//!
+//! @return None.
+//
+//*****************************************************************************
+static void
+TIMER0_init(void)
+{
+  g_samples = 0xFF;
+  g_line_level = true;
+
+  //
+  //  Clear the TIMER0 registers.
+  //
+  TCCR0A = 0x00;
+  TCCR0B = 0x00;
+  TCNT0 = 0x00;
+
+  //
+  //  CTC Mode Setup.
+  //  WGM01: Clear Timer on Compare Match with OCR0A.
+  //  CS01 - CS00: Prescale 64 (4 us per tick).
+  //
+  OCR0A = SAMPLE_PERIOD_TICKS - 1;
+  _set_bit(TCCR0A, WGM01);
+  _set_two_bits(TCCR0B, CS01, CS00);
+
+  //
+  //  Interrupt Service Routines Setup.
+  //  OCIE0A: Output Compare A.
+  //
+  _set_bit(TIFR0, OCF0A);
+  _set_bit(TIMSK0, OCIE0A);
+}
+#endif
+
+//*****************************************************************************
+//
+//! @brief Decodes the events captured since the last call, one by one.
+//!
+//! The events of the slot being captured are decoded as they arrive. Once a
+//! full slot has been decoded it is released to the ISR and the decoder moves
+//! on to the next slot. Nothing is done unless an ISR raised the event flag.
+//!
+//! @return None.
+//
+//*****************************************************************************
+static void
+decode_pending_events(void)
+{
+  uint16_t start_time;
+  uint16_t decode_time;
+
+#ifdef IR_FAST_CAPTURE
+  drain_capture_edges();
+#endif
+
+  if (!g_is_decode_pending)
+  {
+    return;
+  }
+
+  start_time = read_timer();
+
+  //
+  //  Report the frames dropped by the ISR since the last run.
+  //
+  while (g_reported_drops != g_frame_drops)
+  {
+    g_reported_drops++;
+    report_error(IR_ERROR_FRAME_DROP);
+  }
+
+  //
+  //  Clear the flag before reading the slots, so an event captured
+  //  meanwhile raises it again.
+  //
+  g_is_decode_pending = false;
+
+  while (1)
+  {
+    uint8_t slot = g_decode_slot;
+    uint8_t event_cnt;
+    bool is_full;
+
+    //
+    //  The count and the full flag are read together. The ISR never writes
+    //  a full slot, so its count is final and the slot is only released once
+    //  all of its events have been decoded.
+    //
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+      event_cnt = g_event_cnt[slot];
+      is_full = g_is_slot_full[slot];
+    }
+
+    while (g_decode_index < event_cnt)
+    {
+      if (g_is_slot_sir[slot])
+      {
+        decode_sir_byte(slot, g_decode_index);
+      }
+      else
+      {
+        decode_event(g_decode_index, read_symbol(slot, g_decode_index));
+      }
+      g_decode_index++;
+    }
+
+    //
+    //  Stop if the slot is still being captured, the events stored since
+    //  the snapshot raised the event flag again.
+    //
+    if (!is_full)
+    {
+      break;
+    }
+
+    //
+    //  Each slot holds one frame, it is incomplete if still valid here.
+    //
+    if (g_is_frame_valid)
+    {
+      g_is_frame_valid = false;
+      report_error(IR_ERROR_BAD_FRAME);
+    }
+
+    //
+    //  The silence after this slot ended the transmission.
+    //
+    if (g_is_slot_last[slot])
+    {
+      end_transmission();
+    }
+
+    //
+    //  Release the slot, the count must be cleared before the ISR is
+    //  allowed to write the slot again.
+    //
+    g_decode_index = 0;
+    g_event_cnt[slot] = 0;
+    g_is_slot_last[slot] = false;
+    g_is_slot_sir[slot] = false;
+    g_is_slot_full[slot] = false;
+
+    g_decode_slot++;
+    if (g_decode_slot == EVENT_SLOTS)
+    {
+      g_decode_slot = 0;
+    }
+  }
+
+  decode_time = read_timer() - start_time;
+  if (decode_time > g_stats.max_decode_ticks)
+  {
+    g_stats.max_decode_ticks = decode_time;
+  }
+}
+
+//*****************************************************************************
+//
+//! @brief Advances the frame decoder by one event ("red eye" protocol).
+//!
+//! The first event of a frame restarts the decoder. Every following event
+//! closes a pulse, whose symbol gives its width in quarters of bit: the first
+//! five pulses must be the three opening half bits (one quarter each), then
+//! each bit is sampled at its first quarter. The data byte is checked against
+//! the error bits and queued as soon as the last bit has been sampled.
+//!
+//! @param[in] index Position of the event within the frame.
+//! @param[in] symbol Pulse symbol of the event.
+//!
+//! @return None.
+//
+//*****************************************************************************
+static void
+decode_event(uint8_t index, uint8_t symbol)
+{
+  uint8_t quarter_of_bit;
+
+  //
+  //  The first event opens the frame, its width is the gap since the
+  //  previous frame.
+  //
+  if (index == 0)
+  {
+    g_codeword = 0;
+    g_quarter_cnt = 0;
+    g_is_burst = true;
+    g_is_frame_valid = true;
+    g_bit_position = FIRST_BIT_POS;
+    g_stats.frames++;
+    return;
+  }
+
+  if (!g_is_frame_valid)
+  {
+    return;
+  }
+
+  //
+  //  A pulse outside of the windows, or a start half bit longer than one
+  //  quarter, invalidates the rest of the frame.
+  //
+  quarter_of_bit = (symbol << 1) - 1;
+  if (symbol == SYMBOL_INVALID)
+  {
+    g_stats.bad_pulses++;
+  }
+
+  if ((symbol == SYMBOL_INVALID) ||
+      (g_quarter_cnt < START_BITS_QUARTERS - 1 && quarter_of_bit != 1))
+  {
+    g_is_frame_valid = false;
+    report_error(IR_ERROR_BAD_FRAME);
+    return;
+  }
+
+  //
+  //  Sample every bit whose first quarter is covered by this pulse.
+  //
+  g_quarter_cnt += quarter_of_bit;
+  while (g_bit_position < g_quarter_cnt && g_bit_position <= LAST_BIT_POS)
+  {
+    g_codeword <<= 1;
+    if (g_is_burst)
+    {
+      _set_bit(g_codeword, 0);
+    }
+    g_bit_position += QUARTERS_PER_BIT;
+  }
+
+  //
+  //  Queue the data byte once the last bit has been sampled.
+  //
+  if (g_bit_position > LAST_BIT_POS)
+  {
+    uint8_t data;
+    uint8_t status = IR_check_codeword(g_codeword, &data);
+
+    if (status == IR_BYTE_OK)
+    {
+      g_calibration_clock = g_slot_clock[g_decode_slot];
+    }
+    else if (status == IR_BYTE_CORRECTED)
+    {
+      g_stats.corrections++;
+    }
+    else if (status == IR_BYTE_UNCORRECTABLE)
+    {
+      g_stats.uncorrectable++;
+      report_error(IR_ERROR_UNCORRECTABLE);
+    }
+
+    rx_queue_put(data, status);
+    g_is_frame_valid = false;
+  }
+
+  //
+  //  Change logical value for the upcoming pulse.
+  //
+  g_is_burst = !g_is_burst;
+}
+
+//*****************************************************************************
+//
+//! @brief Queues one byte of an IrDA SIR transmission.
+//!
+//! The ISR already decoded the byte. Position 0 of the slot holds the first
+//! event of the transmission, captured before it was detected as SIR, and
+//! is skipped along with the "red eye" frame it opened.
+//!
+//! @param[in] slot Event buffer holding the bytes.
+//! @param[in] index Position of the byte within the slot.
+//!
+//! @return None.
+//
+//*****************************************************************************
+static void
+decode_sir_byte(uint8_t slot, uint8_t index)
+{
+  g_is_frame_valid = false;
+
+  if (index != 0)
+  {
+    rx_queue_put(g_symbol_buffer[slot][index], IR_BYTE_OK);
+  }
+}
+
+//*****************************************************************************
+//
+//! @brief Computes the parity of one byte.
+//!
+//! @param[in] value Byte to evaluate.
+//!
+//! @return 1 if the number of bits set is odd, 0 otherwise.
+//
+//*****************************************************************************
+static uint8_t
+get_parity(uint8_t value)
+{
+  value ^= value >> 4;
+  value ^= value >> 2;
+  value ^= value >> 1;
+
+  return value & 0x01;
+}
+
+//*****************************************************************************
+//
+//! @brief Reads one pulse symbol from the packed symbol buffer.
+//!
+//! @param[in] slot Event buffer holding the frame.
+//! @param[in] index Position of the event within the frame.
+//!
+//! @return Pulse symbol of the event.
+//
+//*****************************************************************************
+static uint8_t
+read_symbol(uint8_t slot, uint8_t index)
+{
+  uint8_t packed = g_symbol_buffer[slot][index >> 2];
+
+  return (packed >> ((index & 0x03) << 1)) & 0x03;
+}
+
+//*****************************************************************************
+//
+//! @brief Puts one decoded byte in the queue.
+//!
+//! If the queue is full the byte is dropped and the overrun counter is
+//! increased, the bytes already queued are never overwritten.
+//!
+//! @param[in] data Decoded byte.
+//! @param[in] status Error bits check of the byte.
+//!
+//! @return None.
+//
+//*****************************************************************************
+static void
+rx_queue_put(uint8_t data, uint8_t status)
+{
+  uint8_t head = g_rx_head;
+
+  //
+  //  A byte handler alone takes the byte, nothing is queued.
+  //
+  if (g_byte_handler)
+  {
+    g_byte_handler(data, status);
+    if (!g_transmission_handler)
+    {
+      g_stats.bytes++;
+      return;
+    }
+  }
+
+  if ((uint8_t)(head - g_rx_tail) == RX_QUEUE_SIZE)
+  {
+    g_rx_overruns++;
+    report_error(IR_ERROR_OVERRUN);
+    return;
+  }
+
+  g_rx_queue[head & RX_QUEUE_MASK] = data;
+  g_rx_status[head & RX_QUEUE_MASK] = status;
+
+  //
+  //  Publish the byte only after it has been written.
+  //
+  g_rx_head = head + 1;
+  g_transmission_length++;
+  g_stats.bytes++;
+}
+
+//*****************************************************************************
+//
+//! @brief Queues the length of the transmission that just ended.
+//!
+//! Transmissions without any decoded byte are not reported. If the
+//! transmission queue is full the bytes are kept and merged with the next
+//! transmission.
+//!
+//! @return None.
+//
+//*****************************************************************************
+static void
+end_transmission(void)
+{
+  uint8_t head = g_transmission_head;
+  uint32_t first_edge = g_slot_first_edge[g_decode_slot];
+  uint32_t last_edge = g_slot_last_edge[g_decode_slot];
+
+  //
+  //  With a transmission handler the bytes start at the beginning of the
+  //  queue, hand them over in place and rewind the queue.
+  //
+  if (g_transmission_handler)
+  {
+    if (g_transmission_length)
+    {
+      g_timestamps.first_edge = first_edge;
+      g_timestamps.last_edge = last_edge;
+      g_timestamps.delivery = IR_get_time();
+      g_transmission_handler(g_rx_queue, g_rx_status, g_transmission_length);
+    }
+    g_rx_head = 0;
+    g_rx_tail = 0;
+    g_transmission_length = 0;
+    return;
+  }
+
+  if (g_transmission_length == 0)
+  {
+    return;
+  }
+
+  if (g_is_transmission_merged)
+  {
+    first_edge = g_merged_first_edge;
+  }
+
+  if ((uint8_t)(head - g_transmission_tail) == TRANSMISSION_QUEUE_SIZE)
+  {
+    g_merged_first_edge = first_edge;
+    g_is_transmission_merged = true;
+    return;
+  }
+
+  g_transmission_queue[head & TRANSMISSION_QUEUE_MASK] = g_transmission_length;
+  g_transmission_first_edge[head & TRANSMISSION_QUEUE_MASK] = first_edge;
+  g_transmission_last_edge[head & TRANSMISSION_QUEUE_MASK] = last_edge;
+  g_transmission_head = head + 1;
+  g_transmission_length = 0;
+  g_is_transmission_merged = false;
+}
+
+//*****************************************************************************
+//
+//! @brief Hands the slot being captured to the decoder.
+//!
+//! Called from the ISRs at the end of a frame. The slot is marked full and
+//! the capture flips to the next slot.
+//!
+//! @param[in] is_last True if the transmission ends with this slot.
+//!
+//! @return None.
+//
+//*****************************************************************************
+static inline void
+close_capture_slot(bool is_last)
+{
+  g_is_slot_last[g_capture_slot] = is_last;
+  g_is_slot_full[g_capture_slot] = true;
+  g_is_decode_pending = true;
+
+  g_capture_slot++;
+  if (g_capture_slot == EVENT_SLOTS)
+  {
+    g_capture_slot = 0;
+  }
+}
+
+//*****************************************************************************
+//
+//! @brief Ends the transmission being captured.
+//!
+//! Called with the interrupts disabled once the transmission is over, either
+//! by the timeout or because the capture is suspended. The slot is handed to
+//! the decoder as the last one of the transmission, with the time stamps of
+//! its first and last edge, unless the frame was dropped. The next event
+//! starts a new frame.
+//!
+//! @param[in] timer_value TIMER1 value at the end of the transmission.
+//!
+//! @return None.
+//
+//*****************************************************************************
+static inline void
+end_capture_transmission(uint16_t timer_value)
+{
+  //
+  //  The last SIR byte has no following start bit, store it now.
+  //
+  if (g_is_sir)
+  {
+    store_sir_byte();
+    g_is_sir = false;
+  }
+
+  //
+  //  Neither has the last pulse a following one.
+  //
+  flush_pending_pulse();
+
+  if (g_event_buffer_index != 0 && g_is_frame_dropped)
+  {
+    g_frame_drops++;
+  }
+  else if (!g_is_slot_full[g_capture_slot])
+  {
+    g_slot_first_edge[g_capture_slot] = g_capture_first_edge;
+    g_slot_last_edge[g_capture_slot] = get_timestamp(timer_value) -
+                                       (uint16_t)(timer_value - g_last_capture);
+    close_capture_slot(true);
+  }
+
+  //
+  //  The next event starts a new frame, with the edge-triggered
+  //  configuration back to the falling edge.
+  //
+  g_event_buffer_index = 0;
+  _clear_bit(TCCR1B, ICES1);
+}
+
+//*****************************************************************************
+//
+//! @brief Tells if the frame being captured may be an IrDA SIR transmission.
+//!
+//! The first pulse of the frame was shorter than SIR_MAX_PULSE and is held
+//! by the glitch filter. A glitch within a "red eye" burst is followed by
+//! the rest of the burst, a SIR start bit by a silence of at least one
+//! SIR_MAX_PULSE.
+//!
+//! @param[in] pulse_width Pulse width after the first pulse, in timer ticks.
+//!
+//! @return True if the frame may be SIR, the next pulse confirms it.
+//
+//*****************************************************************************
+static inline bool
+is_sir_start(uint16_t pulse_width)
+{
+  return (g_event_buffer_index == 1) && g_is_merging &&
+         (g_pending_width < SIR_MAX_PULSE) && (pulse_width >= SIR_MAX_PULSE);
+}
+
+//*****************************************************************************
+//
+//! @brief Switches the capture to an IrDA SIR transmission.
+//!
+//! Called from the capture ISR once the first pulse of the transmission is
+//! known to be the start bit of the first byte. The slot being captured
+//! holds the SIR bytes from now on, and only falling edges are captured.
+//!
+//! @param[in] byte_start Capture time of the first start bit.
+//!
+//! @return None.
+//
+//*****************************************************************************
+static inline void
+start_sir(uint16_t byte_start)
+{
+  g_is_sir = true;
+  g_sir_data = 0xFF;
+  g_sir_byte_start = byte_start;
+  g_event_buffer_index = 1;
+  g_is_pulse_pending = false;
+  g_is_merging = false;
+  g_pending_width = 0;
+
+  if (!g_is_frame_dropped)
+  {
+    g_is_slot_sir[g_capture_slot] = true;
+  }
+
+  //
+  //  The fast capture ISR owns the polarity while edges may be queued, the
+  //  rising edges are skipped instead.
+  //
+#ifndef IR_FAST_CAPTURE
+  _clear_bit(TCCR1B, ICES1);
+#endif
+}
+
+//*****************************************************************************
+//
+//! @brief Decodes one IrDA SIR pulse.
+//!
+//! Called from the capture ISR at each falling edge. The position of the
+//! pulse from the start bit gives the data bit it clears. A pulse past the
+//! stop bit is the start bit of the next byte.
+//!
+//! @param[in] timer_value Capture time of the pulse.
+//!
+//! @return None.
+//
+//*****************************************************************************
+static inline void
+capture_sir_pulse(uint16_t timer_value)
+{
+  uint16_t elapsed = timer_value - g_sir_byte_start;
+  uint8_t bit;
+
+  if (elapsed >= SIR_BYTE_TICKS)
+  {
+    store_sir_byte();
+    g_sir_data = 0xFF;
+    g_sir_byte_start = timer_value;
+    return;
+  }
+
+  //
+  //  Data bits are 1 to 8, 0 is the start bit and 9 the stop bit.
+  //
+  bit = (uint8_t)((elapsed * SIR_BIT_SCALE + SIR_BIT_ROUNDING) >>
+                  SIR_BIT_SHIFT);
+  if (bit >= 1 && bit <= 8)
+  {
+    g_sir_data &= ~_BV(bit - 1);
+  }
+}
+
+//*****************************************************************************
+//
+//! @brief Stores the SIR byte just completed in the slot being captured.
+//!
+//! A full slot is handed to the decoder and the next one continues the
+//! transmission, or drops its bytes if it was not decoded yet.
+//!
+//! @return None.
+//
+//*****************************************************************************
+static inline void
+store_sir_byte(void)
+{
+  if (!g_is_frame_dropped)
+  {
+    g_symbol_buffer[g_capture_slot][g_event_buffer_index] = g_sir_data;
+    g_event_cnt[g_capture_slot] = g_event_buffer_index + 1;
+    g_is_decode_pending = true;
+  }
+
+  g_event_buffer_index++;
+  if (g_event_buffer_index == SYMBOL_BUFFER_SIZE)
+  {
+    end_capture_frame();
+
+    g_is_frame_dropped = g_is_slot_full[g_capture_slot];
+    if (!g_is_frame_dropped)
+    {
+      g_is_slot_sir[g_capture_slot] = true;
+    }
+    g_event_buffer_index = 1;
+  }
+}
+
+//*****************************************************************************
+//
+//! @brief Ends the frame being captured.
+//!
+//! Called from the capture ISR when the frame is complete or when a frame
+//! gap arrives before it is. The slot is handed to the decoder, unless the
+//! frame was dropped.
+//!
+//! @return None.
+//
+//*****************************************************************************
+static inline void
+end_capture_frame(void)
+{
+  g_event_buffer_index = 0;
+
+  if (g_is_frame_dropped)
+  {
+    g_frame_drops++;
+  }
+  else
+  {
+    close_capture_slot(false);
+  }
+}
+
+//*****************************************************************************
+//
+//! @brief Classifies one pulse by its width.
+//!
+//! Evaluates how many quarters of bit the pulse has against the windows of
+//! the current frame, called from the ISR.
+//!
+//! @param[in] pulse_width Pulse width in timer ticks (4 us).
+//!
+//! @return Pulse symbol, SYMBOL_INVALID if out of all windows.
+//
+//*****************************************************************************
+static inline uint8_t
+get_pulse_symbol(uint16_t pulse_width)
+{
+  uint8_t symbol = SYMBOL_INVALID;
+
+  if (pulse_width <= g_min_width)
+  {
+    symbol = SYMBOL_INVALID;
+  }
+  else if (pulse_width < g_one_quarter_max)
+  {
+    symbol = SYMBOL_ONE_QUARTER;
+  }
+  else if (pulse_width < g_three_quarters_max)
+  {
+    symbol = SYMBOL_THREE_QUARTERS;
+  }
+  else if (pulse_width < g_five_quarters_max)
+  {
+    symbol = SYMBOL_FIVE_QUARTERS;
+  }
+
+  return symbol;
+}
+
+//*****************************************************************************
+//
+//! @brief Derives the pulse width windows from the recovered bit clock.
+//!
+//! With q = clock_ticks / 4 (one quarter of bit), the windows are centered on
+//! 1, 3 and 5 quarters: (q/2, 2q), [2q, 4q) and [4q, 6q). Only shifts are
+//! needed, so this is cheap enough for the ISR and tolerates any clock skew
+//! that keeps the opening pulses within the nominal window.
+//!
+//! @param[in] clock_ticks Width of the first two half bits in timer ticks.
+//!
+//! @return None.
+//
+//*****************************************************************************
+static inline void
+set_pulse_windows(uint16_t clock_ticks)
+{
+  g_min_width = clock_ticks >> 3;
+  g_one_quarter_max = clock_ticks >> 1;
+  g_three_quarters_max = clock_ticks;
+  g_five_quarters_max = clock_ticks + (clock_ticks >> 1);
+}
+
+//*****************************************************************************
+//
+//! @brief Extends a TIMER1 value to a 32-bit time stamp.
+//!
+//! Called with the interrupts disabled. If the timer has overflowed but the
+//! Overflow ISR did not run yet, TOV1 is still set: a small timer value was
+//! taken after that overflow, a large one before it.
+//!
+//! @param[in] timer_value TIMER1 value taken within the last 131 ms.
+//!
+//! @return Time stamp in timer ticks (4 us).
+//
+//*****************************************************************************
+static inline uint32_t
+get_timestamp(uint16_t timer_value)
+{
+  uint16_t overflows = g_timer_overflows;
+
+  if (_read_bit(TIFR1, TOV1) && timer_value < 0x8000)
+  {
+    overflows++;
+  }
+
+  return ((uint32_t)overflows << 16) | timer_value;
+}
+
+//*****************************************************************************
+//
+//! @brief Reads the TIMER1 counter.
+//!
+//! The 16-bit access uses the TEMP register of the TIMER1, which the capture
+//! ISR also uses to read ICR1, so the interrupts are disabled meanwhile.
+//!
+//! @return Current value of TCNT1.
+//
+//*****************************************************************************
+static inline uint16_t
+read_timer(void)
+{
+  uint16_t timer_value;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    timer_value = TCNT1;
+  }
+
+  return timer_value;
+}
+
+//*****************************************************************************
+//
+//! @brief Loads the timing profile saved in the EEPROM.
 //!
-//! @return None.
+//! @return True if a valid profile was found and applied.
 //
 //*****************************************************************************
-void
-IR_Reciever_init(void)
+static bool
+load_profile(void)
 {
-  g_byte_cnt = 0;
-  g_last_event = 0;
-  g_virtual_cnt = 0;
-  g_event_buffer_index = 0;
-  g_is_edge_falling = true;
-  g_is_event_buffer_full = false;
+  struct Profile_Record record;
 
-  TIMER1_init();
+  eeprom_read_block(&record, &g_eeprom_profile, sizeof(record));
+
+  if (record.version != PROFILE_VERSION ||
+      record.checksum != get_checksum(&record.profile) ||
+      !is_profile_valid(&record.profile))
+  {
+    return false;
+  }
+
+  g_profile = record.profile;
+
+  return true;
 }
 
 //*****************************************************************************
 //
-//! @brief Returns the data buffer to the user.
+//! @brief Checks that a timing profile can be used by the ISRs.
 //!
-//! @return g_data_buffer Pointer to the data buffer.
+//! @param[in] profile Timing profile to check.
+//!
+//! @return True if the windows are increasing, the gaps longer than the
+//! widest window and the guard time at least MIN_GUARD_TIME.
 //
 //*****************************************************************************
-uint8_t*
-IR_get_data(void)
+static bool
+is_profile_valid(const struct IR_Profile* profile)
 {
-  return g_data_buffer;
+  return (profile->min_width < profile->one_quarter_max) &&
+         (profile->one_quarter_max < profile->three_quarters_max) &&
+         (profile->three_quarters_max < profile->five_quarters_max) &&
+         (profile->five_quarters_max < profile->transmission_gap) &&
+         (profile->guard_time >= MIN_GUARD_TIME);
 }
 
 //*****************************************************************************
 //
-//! @brief Indicates to the user that data is ready.
+//! @brief Computes the checksum of a timing profile.
 //!
-//! This function checks if there is any pending event, if note the user is
-//! informed to proceed with the data acquisition.
+//! @param[in] profile Timing profile.
 //!
-//! @return status Flag to indicate data availability.
+//! @return Sum of the bytes of the profile.
 //
 //*****************************************************************************
-bool
-IR_is_data_available(void)
+static uint8_t
+get_checksum(const struct IR_Profile* profile)
 {
-  bool status = false;
-
-  //
-  //  Check if there is pending data to be updated
-  //
-  if (g_is_event_buffer_full)
-  {
-    update_data_buffer();
-    g_is_event_buffer_full = false;
-  }
+  uint8_t i;
+  uint8_t checksum = 0;
+  const uint8_t* bytes = (const uint8_t*)profile;
 
-  //
-  //  If all 12 bytes (30 events each) have been stored,
-  //  then return true.
-  //
-  if (g_byte_cnt == DATA_BUFFER_SIZE)
+  for (i = 0; i < sizeof(*profile); i++)
   {
-    status = true;
-    g_byte_cnt = 0;
+    checksum += bytes[i];
   }
 
-  return status;
+  return checksum;
 }
 
 //*****************************************************************************
 //
-//  Private Functions.
+//! @brief Calls the error handler, if any.
+//!
+//! @param[in] error Error of the reciever (IR_Error).
+//!
+//! @return None.
 //
 //*****************************************************************************
+static void
+report_error(uint8_t error)
+{
+  if (g_error_handler)
+  {
+    g_error_handler(error);
+  }
+}
+
 //*****************************************************************************
 //
-//! @brief Initialize the TIMER1 in Input Capture Mode.
+//! @brief Stores one pulse of the frame being captured.
 //!
-//! This function resets and configures the TIMER1 registers to operate in
-//! Input Capture Mode. The TIMER1 is configured to run at the maximun speed
-//! (no prescaler) to capture real time. Two interrupt service routines are
-//! set, the Overflow ISR and the Input Capture ISR at a falling edge.
+//! Called from the ISRs once the pulse is final, after the glitch filter.
+//! The first pulse of a frame is the gap before it.
+//!
+//! @param[in] pulse_width Pulse width in timer ticks (4 us).
 //!
 //! @return None.
 //
 //*****************************************************************************
-static void
-TIMER1_init(void)
+static inline void
+store_pulse(uint16_t pulse_width)
 {
   //
-  //  Clear the TIMER1 registers.
+  //  At the start of a frame, drop it if the slot is still waiting for the
+  //  decoder, and classify the opening half bits with the nominal windows.
+  //  Once they are captured, the windows follow the bit clock of the frame.
   //
-  TCCR1A = 0x00;
-  TCCR1C = 0x00;
+  if (g_event_buffer_index == 0)
+  {
+    g_is_frame_dropped = g_is_slot_full[g_capture_slot];
+
+    g_clock_ticks = 0;
+    g_min_width = g_profile.min_width;
+    g_one_quarter_max = g_profile.one_quarter_max;
+    g_three_quarters_max = g_profile.three_quarters_max;
+    g_five_quarters_max = g_profile.five_quarters_max;
+  }
+  else if (g_event_buffer_index <= CLOCK_RECOVERY_PULSES)
+  {
+    g_clock_ticks += pulse_width;
+  }
 
   //
-  //  Input Capture Mode Setup.
-  //  CS10: Prescale 1 (Maximum Timer Speed).
-  //  ICNC1: Enable Input Capture Noise Canceler.
-  //  ICES1: Capture Falling Edge.
+  //  Store the pulse symbol. The symbol is moved to its position with
+  //  constant shifts, the first symbol of each byte also clears the previous
+  //  content.
   //
-  _set_two_bits(TCCR1B, ICNC1, CS10);
-  _clear_bit(TCCR1B, ICES1);
+  if (!g_is_frame_dropped)
+  {
+    uint8_t index = g_event_buffer_index;
+    uint8_t packed = get_pulse_symbol(pulse_width);
+    volatile uint8_t* symbols = &g_symbol_buffer[g_capture_slot][index >> 2];
+
+    if (index & 0x01)
+    {
+      packed <<= 2;
+    }
+    if (index & 0x02)
+    {
+      packed <<= 4;
+    }
+
+    if ((index & 0x03) == 0)
+    {
+      *symbols = packed;
+    }
+    else
+    {
+      *symbols |= packed;
+    }
+
+    g_event_cnt[g_capture_slot] = index + 1;
+    g_is_decode_pending = true;
+  }
+
+  if (g_event_buffer_index == CLOCK_RECOVERY_PULSES)
+  {
+    set_pulse_windows(g_clock_ticks);
+    g_slot_clock[g_capture_slot] = g_clock_ticks;
+  }
 
   //
-  //  Interrupt Service Routines Setup.
-  //  ICIE1: Input Capture.
-  //  TOIE1: TIMER1 OverFlow.
+  //  Increase event buffer index, at the end of the frame hand the slot to
+  //  the decoder.
   //
-  _set_two_bits(TIFR1, ICF1, TOV1);
-  _set_two_bits(TIMSK1, ICIE1, TOIE1);
+  g_event_buffer_index++;
+  if (g_event_buffer_index == EVENT_BUFFER_SIZE)
+  {
+    end_capture_frame();
+  }
 }
 
 //*****************************************************************************
 //
-//! @brief Updates the data buffer (one data frame from "red eye" protocol).
+//! @brief Stores the pulse held by the glitch filter, if any.
 //!
-//! This function processes each of the 30 events in the event buffer to
-//! determine the logic level, either 1 or 0, and the bit position of all
-//! eight data bits within the frame. Each time this functions is executed
-//! a new byte is stored in the data buffer.
+//! A glitch still waiting for its next pulse is merged as it is. Pulses held
+//! after a complete frame are spurious and discarded.
 //!
 //! @return None.
 //
 //*****************************************************************************
-static void
-update_data_buffer(void)
+static inline void
+flush_pending_pulse(void)
 {
-  //
-  //  General counter varaibles for loops and events.
-  //
-  uint8_t i, j;
-  uint8_t event_cnt = 0;
-  uint8_t quater_of_bit = 0;
-  bool state = true;
+  if (g_is_pulse_pending && g_event_buffer_index != 0)
+  {
+    store_pulse(g_pending_width);
+  }
+  g_is_pulse_pending = false;
+  g_is_merging = false;
+  g_pending_width = 0;
+  g_sir_silence = 0;
+}
+
+#ifdef IR_FAST_CAPTURE
+//*****************************************************************************
+//
+//! @brief Hands the edges queued by the fast capture ISR to capture_event().
+//!
+//! Called by the decoder and by the transmission timeout. Each edge is
+//! processed with the interrupts disabled, as capture_event() shares its
+//! state with the TIMER1 ISRs, but they are enabled again between edges.
+//!
+//! The main loop must drain the ring well within the transmission gap: the
+//! ring holds 8 edges, about 2 ms of "red eye" bursts. A ring found full is
+//! counted as a frame drop, and an edge drained after the gap has expired
+//! fires the timeout at once.
+//!
+//! @return True if any edge was queued.
+//
+//*****************************************************************************
+static bool
+drain_capture_edges(void)
+{
+  bool is_drained = false;
+  bool is_empty = false;
 
-  for (i = 0; i < EVENT_BUFFER_SIZE; i++)
+  while (!is_empty)
   {
-    //
-    //  The first value is ignored.
-    //
-    if(i > 0)
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
     {
-      //
-      //  Calculate the pulse width.
-      //
-      uint16_t pulse_width = (uint16_t)g_event_buffer[i] - g_last_event;
-
-      //
-      //  Evalute of many quater of bit the pulse has, time is givin in us.
-      //
-      if (pulse_width > 20 && pulse_width < 100)
-      {
-        quater_of_bit = 1;
-      }
-      else if (pulse_width > 120 && pulse_width < 200)
-      {
-        quater_of_bit = 3;
-      }
-      else if (pulse_width > 220 && pulse_width < 300)
-      {
-        quater_of_bit = 5;
-      }
+      uint8_t tail = GPIOR1;
 
-      //
-      //  Loop through the quaters of a bit until reaching the data frame
-      //
-      for (j = 0; j < quater_of_bit; j++)
+      is_empty = (tail == GPIOR0);
+      if (!is_empty)
       {
+        uint16_t timer_value = g_capture_edges[tail].timer_value;
+
         //
-        //  The data frame start at the 23th position, MSB is sent first.
+        //  A full ring has dropped the edges that came meanwhile, the frame
+        //  being captured has lost edges and is counted as dropped.
         //
-        if (event_cnt == EIGHTH_BIT_POS) find_bit_position(event_cnt, state);
-        event_cnt++;
-      }
+        if (((GPIOR0 + 1) & (CAPTURE_EDGES - 1)) == tail)
+        {
+          g_frame_drops++;
+        }
 
-      //
-      //  Change logical value for the upcoming bit.
-      //
-      state = !state;
-    }
+        capture_event(timer_value,
+                      _read_bit(g_capture_edges[tail].control, ICES1));
+        GPIOR1 = (tail + 1) & (CAPTURE_EDGES - 1);
+        is_drained = true;
 
-    //
-    //  Store the last event for pulse width calculation.
-    //
-    g_last_event = g_event_buffer[i];
+        //
+        //  An edge drained later than the transmission gap has armed the
+        //  timeout behind TCNT1, where it would only fire once the timer
+        //  wraps. It fires right away instead, unless another edge follows.
+        //
+        if ((uint16_t)(TCNT1 - timer_value) >= g_profile.transmission_gap)
+        {
+          OCR1A = TCNT1 + 1;
+        }
+      }
+    }
   }
+
+  return is_drained;
 }
+#endif
 
 //*****************************************************************************
 //
-//! @brief Finds an specific bit position.
+//! @brief Processes one event (edge) of the IR sensor.
 //!
-//! This function evalutes the bit position passed to determine where should
-//! be written the logic level.
+//! Called from the ISR of the engine in use. It measures the pulse width
+//! (time elapsed since the last event) as a 16-bit wraparound difference of
+//! TIMER1 values and stores it as a 2-bit pulse symbol. In each event the
+//! edge-triggered configuration is toggled from falling to rising and
+//! viceversa to guarantee a next capture. Frames start after a gap longer
+//! than any pulse and end after 30 events or at the next gap. When a frame
+//! ends the ISR flips to the next event buffer; if that buffer has not been
+//! decoded yet the following frame is dropped as a whole.
 //!
-//! @param[in] bit_position Postion of one bit in the data frame.
-//! @param[in] logic_level Logic level of the bit, true or false (1 or 0).
+//! @param[in] timer_value TIMER1 value at the edge.
+//! @param[in] is_rising_edge True for a rising edge (end of a burst).
 //!
 //! @return None.
 //
 //*****************************************************************************
-static void
-find_bit_position(uint8_t bit_position, bool logic_level)
+static inline void
+capture_event(uint16_t timer_value, bool is_rising_edge)
 {
-  switch (bit_position)
+  //
+  //  The unsigned subtraction handles the timer wraparound as long as the
+  //  pulse is shorter than 262 ms.
+  //
+  uint16_t pulse_width = timer_value - g_last_capture;
+  bool is_first = !_read_bit(TIMSK1, OCIE1A);
+
+  g_last_capture = timer_value;
+  g_edge_cnt++;
+
+  //
+  //  The first edge after the timeout, the init or a resume opens a
+  //  transmission, stamp it. The silence before it can be longer than the
+  //  timer wraparound, so it is a gap whatever the wrapped width.
+  //
+  if (is_first)
+  {
+    g_capture_first_edge = get_timestamp(timer_value);
+    if (pulse_width < g_five_quarters_max)
+    {
+      pulse_width = g_five_quarters_max;
+    }
+  }
+
+  //
+  //  Arm the end of transmission timeout.
+  //
+  OCR1A = timer_value + g_profile.transmission_gap;
+  _set_bit(TIFR1, OCF1A);
+  _set_bit(TIMSK1, OCIE1A);
+
+  //
+  //  A SIR transmission only needs the falling edges, until the timeout.
+  //
+  if (g_is_sir)
+  {
+    if (!is_rising_edge)
+    {
+      capture_sir_pulse(timer_value);
+    }
+    return;
+  }
+
+  //
+  //  Switch the edge-triggered configuration (falling <-> rising). The fast
+  //  capture ISR has already done it.
+  //
+#ifndef IR_FAST_CAPTURE
+  _toggle_bit(TCCR1B, ICES1);
+#endif
+
+  //
+  //  A pulse longer than the widest window is the gap between two frames.
+  //  Frames are carved by these gaps, so a missed or spurious event only
+  //  damages its own frame.
+  //
+  if (pulse_width >= g_five_quarters_max)
   {
-    case FIRST_BIT_POS:
-      write_bit(0, logic_level);
-    break;
+    //
+    //  The last pulse of the previous frame is still pending.
+    //
+    flush_pending_pulse();
 
-    case SECOND_BIT_POS:
-      write_bit(1, logic_level);
-    break;
+    //
+    //  A frame still open has lost events, hand it over as it is.
+    //
+    if (g_event_buffer_index != 0)
+    {
+      g_resyncs++;
+      end_capture_frame();
+    }
 
-    case THIRD_BIT_POS:
-      write_bit(2, logic_level);
-    break;
+    //
+    //  The line is idle high between frames, so a gap ending with a rising
+    //  edge means the capture is out of phase. Wait for the next gap.
+    //
+    if (is_rising_edge)
+    {
+      return;
+    }
 
-    case FOURTH_BIT_POS:
-      write_bit(3, logic_level);
-    break;
+    store_pulse(pulse_width);
+    return;
+  }
 
-    case FIFTH_BIT_POS:
-      write_bit(4, logic_level);
-    break;
+  if (g_event_buffer_index == 0)
+  {
+    //
+    //  Spurious events after a complete frame, wait for the next gap.
+    //
+    return;
+  }
 
-    case SIXTH_BIT_POS:
-      write_bit(5, logic_level);
-    break;
+  //
+  //  The first pulse of a SIR transmission is taken as a glitch at first.
+  //  A short pulse, a silence and a short pulse again is SIR; a short pulse
+  //  and a silence followed by a burst was a glitch before the frame, which
+  //  really starts at the end of the silence.
+  //
+  if (g_sir_silence != 0)
+  {
+    uint16_t silence = g_sir_silence;
 
-    case SEVENTH_BIT_POS:
-      write_bit(6, logic_level);
-    break;
+    g_sir_silence = 0;
+    if (pulse_width < SIR_MAX_PULSE)
+    {
+      start_sir(timer_value - pulse_width - silence - g_pending_width);
+      capture_sir_pulse(timer_value - pulse_width);
+      return;
+    }
 
-    case EIGHTH_BIT_POS:
-      write_bit(7, logic_level);
-    break;
+    g_glitches++;
+    g_event_buffer_index = 0;
+    flush_pending_pulse();
+    store_pulse(g_profile.five_quarters_max);
+  }
+  else if (is_sir_start(pulse_width))
+  {
+    g_sir_silence = pulse_width;
+    return;
   }
-}
 
-//*****************************************************************************
-//
-//! @brief Writes either 1 or 0 in the passed bit.
-//!
-//! @param[in] bit Specific bit postion form 0-7.
-//! @param[in] logic_level Logic level of the bit, true or false (1 or 0).
-//!
-//! @return None.
-//
-//*****************************************************************************
-static void
-write_bit(uint8_t bit, bool logic_level)
-{
   //
-  //  Based on the logic level value the bit position will be set (1) or clear (0)
+  //  Glitch filter. Each pulse is held one event before it is classified.
+  //  A pulse under the minimum width is a glitch that split a longer pulse:
+  //  the glitch and the rest of the split pulse, whatever its width, are
+  //  added to the pending one. The first pulse of a frame has no pulse
+  //  before it, so if both it and the next one are short they are the first
+  //  part of the split pulse and the glitch, and the rest is still to come.
   //
-  if (logic_level)
+  if (g_is_merging)
+  {
+    g_is_merging = (g_event_buffer_index == 1) &&
+                   (g_pending_width <= g_min_width) &&
+                   (pulse_width <= g_min_width);
+    g_pending_width += pulse_width;
+    if (g_is_merging)
+    {
+      return;
+    }
+    g_glitches++;
+  }
+  else if (pulse_width <= g_min_width)
   {
-    _set_bit(g_data_buffer[g_byte_cnt], bit);
+    g_pending_width += pulse_width;
+    g_is_pulse_pending = true;
+    g_is_merging = true;
+    return;
   }
   else
   {
-    _clear_bit(g_data_buffer[g_byte_cnt], bit);
+    flush_pending_pulse();
+    g_pending_width = pulse_width;
+    g_is_pulse_pending = true;
+  }
+
+  //
+  //  The last pulse of the frame ends at its last edge, nothing can merge
+  //  into it anymore. It is stored right away, so the byte is decoded as
+  //  soon as that edge arrives instead of at the next frame or timeout.
+  //
+  if (g_event_buffer_index == EVENT_BUFFER_SIZE - 1)
+  {
+    flush_pending_pulse();
   }
 }
 
@@ -367,82 +2352,260 @@ write_bit(uint8_t bit, bool logic_level)
 //*****************************************************************************
 //*****************************************************************************
 //
-//! @brief ISR vector for the TIMER1 OverFlow.
+//! @brief ISR vector for the TIMER1 Capture Input.
+//!
+//! Input capture engine, each edge is timed by the TIMER1 capture register
+//! and handed to capture_event().
+//!
+//! The ISR used to extend each capture to a 64-bit virtual counter, whose
+//! add forced the compiler to save r10-r17 on top of the call clobbered
+//! registers and to move 8 bytes per event. The 32-bit time stamp is only
+//! built for the first edge of each transmission, and TIMER1_OVF is back as
+//! a 16-bit increment every 262 ms. Each pulse is then classified and
+//! packed as a 2-bit symbol, so one frame takes 8 bytes of SRAM instead of
+//! 240.
+//!
+//! Estimated cost per edge, hand-counted from the avr-gcc -Os instruction
+//! sequence and not measured on a target (ATmega328p, cycles including
+//! interrupt response, prologue, epilogue and reti):
 //!
-//! This ISR updates a global virtual counter to keep track of the overall
-//! time elapsed since the first Input Capture ISR. In the last two bytes
-//! of this virtual counter the TIMER1 High and Low byte will be added.
+//!   64-bit virtual counter (before):    ~175 cycles + ~90 cycles TIMER1_OVF
+//!   16-bit delta, raw store (before):   ~95 cycles
+//!   capture_event(), mid-frame edge:    ~230 cycles
+//!
+//! Of the current ~230 cycles, ~70 are the interrupt overhead and the call
+//! clobbered registers, ~35 the delta, the timeout and the polarity, ~35
+//! the gap, SIR and glitch checks and ~90 store_pulse(), which classifies
+//! and packs the symbol. The first edge of a transmission adds ~30 for its
+//! time stamp.
 //
 //*****************************************************************************
-ISR (TIMER1_OVF_vect)
+#ifndef IR_FAST_CAPTURE
+ISR (TIMER1_CAPT_vect)
 {
   //
-  //  += (uint64_t) 0x10000.
-  //  00000000 -> byte 6.
-  //  00000000 -> byte 5.
-  //  00000000 -> byte 4.
-  //  00000001 -> byte 3.
-  //  00000000 -> byte 2 (TIMER1 High Byte - ICR1H).
-  //  00000000 -> byte 1 (TIMER1 Low Byte - ICR1L).
+  //  Capture the current time in TIMER1 (16-bit access reads ICR1L first).
   //
-  g_virtual_cnt += (uint64_t) 0x10000;
+  capture_event(ICR1, _read_bit(TCCR1B, ICES1));
 }
-
+#else
 //*****************************************************************************
 //
-//! @brief ISR vector for the TIMER1 Capture Input.
+//! @brief Fast ISR vector for the TIMER1 Capture Input (IR_FAST_CAPTURE).
+//!
+//! Naked ISR that only flips the edge polarity and queues the capture time
+//! and the polarity in g_capture_edges, for capture_event() to process them
+//! from the decoder. It saves SREG and four registers instead of the call
+//! clobbered set, and its state (head and tail of the ring) lives in GPIOR0
+//! and GPIOR1, reached with single cycle in/out. An edge that finds the
+//! ring full is dropped, and the frame resyncs at the next gap.
+//!
+//! Estimated worst-case cost per edge, counted instruction by instruction
+//! from the AVR instruction set timings and not measured on a target
+//! (ATmega328p, cycles):
+//!
+//!   interrupt response and vector jmp:   7
+//!   prologue (4 push, SREG):            11
+//!   flip ICES1:                          6
+//!   ring index and full check:           7
+//!   entry address, head update:          6
+//!   store ICR1 and polarity:            10
+//!   epilogue and reti:                  15
+//!   total:                             ~62 (3.9 us at 16 MHz)
 //!
-//! This ISR access the TIMER1 High and Low byte to get the pulse width in us
-//! (time elapsed since the last event). In each event the edge-triggered
-//! configuration must be switched from falling to rising and viceversa to
-//! guarantee a next call.
+//! Plus up to 4 cycles to finish the current instruction, 4 more to wake up
+//! from idle sleep, and the ISR that is running when the edge comes. Edges
+//! are taken back to back about every 62 cycles, eight at most before the
+//! decoder drains them; the sustained rate is set by capture_event() in the
+//! decoder. The fastest "red eye" edges come every 244 us and SIR edges
+//! every 19.5 us, so the ring never fills while the main loop runs.
 //
 //*****************************************************************************
-ISR (TIMER1_CAPT_vect)
+ISR (TIMER1_CAPT_vect, ISR_NAKED)
 {
-  //
-  //  Capture the current time in TIMER1.
-  //  ICR1H: High Byte.
-  //  ICR1L: Low Byte.
-  //
-  uint16_t timer_value = ((ICR1H << 8) | ICR1L);
+  __asm__ __volatile__
+  (
+    "push r30"                              "\n\t"
+    "in   r30, __SREG__"                    "\n\t"
+    "push r30"                              "\n\t"
+    "push r31"                              "\n\t"
+    "push r24"                              "\n\t"
+    "push r25"                              "\n\t"
 
-  //
-  //  Switch the edge-triggered configuration.
-  //
-  if (g_is_edge_falling)
-  {
     //
-    //  Capture rising edge next time.
+    //  Flip the edge polarity, r25 keeps the one of this edge.
     //
-    _set_bit(TCCR1B, ICES1);
-  }
-  else
-  {
+    "lds  r25, %[tccr1b]"                   "\n\t"
+    "ldi  r24, %[ices1]"                    "\n\t"
+    "eor  r24, r25"                         "\n\t"
+    "sts  %[tccr1b], r24"                   "\n\t"
+
     //
-    //  Capture falling edge next time.
+    //  Next head, drop the edge if the ring is full.
     //
-    _clear_bit(TCCR1B, ICES1);
-  }
-  g_is_edge_falling = !g_is_edge_falling;
+    "in   r30, %[head]"                     "\n\t"
+    "mov  r24, r30"                         "\n\t"
+    "inc  r24"                              "\n\t"
+    "andi r24, %[mask]"                     "\n\t"
+    "in   r31, %[tail]"                     "\n\t"
+    "cp   r24, r31"                         "\n\t"
+    "breq 1f"                               "\n\t"
 
-  //
-  //  Store the input capture time of rising/falling edge-triggered.
-  //
-  g_event_buffer[g_event_buffer_index] = g_virtual_cnt + timer_value;
+    //
+    //  The entry is filled before the decoder can see the head, as it only
+    //  reads the ring with the interrupts disabled.
+    //
+    "out  %[head], r24"                     "\n\t"
+    "lsl  r30"                              "\n\t"
+    "lsl  r30"                              "\n\t"
+    "clr  r31"                              "\n\t"
+    "subi r30, lo8(-(%[edges]))"            "\n\t"
+    "sbci r31, hi8(-(%[edges]))"            "\n\t"
+
+    //
+    //  16-bit access, ICR1L first.
+    //
+    "lds  r24, %[icr1l]"                    "\n\t"
+    "st   Z+, r24"                          "\n\t"
+    "lds  r24, %[icr1h]"                    "\n\t"
+    "st   Z+, r24"                          "\n\t"
+    "st   Z, r25"                           "\n\t"
+
+    "1:"                                    "\n\t"
+    "pop  r25"                              "\n\t"
+    "pop  r24"                              "\n\t"
+    "pop  r31"                              "\n\t"
+    "pop  r30"                              "\n\t"
+    "out  __SREG__, r30"                    "\n\t"
+    "pop  r30"                              "\n\t"
+    "reti"                                  "\n\t"
+    :
+    : [tccr1b] "n" (_SFR_MEM_ADDR(TCCR1B)),
+      [icr1l] "n" (_SFR_MEM_ADDR(ICR1L)),
+      [icr1h] "n" (_SFR_MEM_ADDR(ICR1H)),
+      [head] "I" (_SFR_IO_ADDR(GPIOR0)),
+      [tail] "I" (_SFR_IO_ADDR(GPIOR1)),
+      [ices1] "M" (_BV(ICES1)),
+      [mask] "M" (CAPTURE_EDGES - 1),
+      [edges] "i" (g_capture_edges)
+  );
+}
+#endif
 
+//*****************************************************************************
+//
+//! @brief ISR vector for the TIMER1 Compare Match A.
+//!
+//! This ISR is reached after the transmission gap of the timing profile
+//! since the last event, so the transmission has ended. A partial frame is
+//! handed to the decoder as it is; otherwise the free slot is handed empty
+//! to mark the end of the transmission. If no slot is free, frames are
+//! already being dropped and the end mark is dropped with them.
+//
+//*****************************************************************************
+ISR (TIMER1_COMPA_vect)
+{
+#ifdef IR_FAST_CAPTURE
   //
-  //  Increase event buffer index.
+  //  Edges still queued belong to the transmission, they are drained while
+  //  the timeout is armed and arm it again.
   //
-  g_event_buffer_index++;
+  if (drain_capture_edges())
+  {
+    return;
+  }
+#endif
 
   //
-  //  Check if event buffer is full.
+  //  One shot timeout, it is armed again by the next event.
   //
-  if (g_event_buffer_index == EVENT_BUFFER_SIZE)
+  _clear_bit(TIMSK1, OCIE1A);
+
+  end_capture_transmission(OCR1A);
+}
+
+//*****************************************************************************
+//
+//! @brief ISR vector for the TIMER1 Overflow.
+//!
+//! Counts the overflows (every 262 ms) to extend the captures to 32-bit time
+//! stamps. A 16-bit increment, so the cost is negligible.
+//!
+//! @return None.
+//
+//*****************************************************************************
+ISR (TIMER1_OVF_vect)
+{
+  g_timer_overflows++;
+}
+
+//*****************************************************************************
+//
+//! @brief ISR vector for the TIMER1 Output Compare B.
+//!
+//! The guard time after IR_Reciever_resume() has elapsed. The capture is
+//! enabled again waiting for a falling edge, and the last capture is moved
+//! back so the first event is taken as the gap before a frame.
+//!
+//! @return None.
+//
+//*****************************************************************************
+ISR (TIMER1_COMPB_vect)
+{
+  _clear_bit(TIMSK1, OCIE1B);
+
+  g_event_buffer_index = 0;
+  flush_pending_pulse();
+  g_five_quarters_max = g_profile.five_quarters_max;
+  g_last_capture = OCR1B - g_profile.five_quarters_max;
+  _clear_bit(TCCR1B, ICES1);
+
+#ifdef IR_OVERSAMPLING
+  if (g_engine == IR_ENGINE_OVERSAMPLING)
+  {
+    g_samples = 0xFF;
+    g_line_level = true;
+    _set_bit(TIFR0, OCF0A);
+    _set_bit(TIMSK0, OCIE0A);
+    return;
+  }
+#endif
+
+  _set_bit(TIFR1, ICF1);
+  _set_bit(TIMSK1, ICIE1);
+}
+
+#ifdef IR_OVERSAMPLING
+//*****************************************************************************
+//
+//! @brief ISR vector for the TIMER0 Compare Match A.
+//!
+//! Oversampling engine, samples the IR sensor and hands every change of the
+//! voted line level to capture_event(), as an edge dated back by EDGE_DELAY.
+//! A glitch shorter than 2 samples never changes the vote.
+//!
+//! Estimated cost, hand-counted and not measured (avr-gcc -Os, ATmega328p,
+//! cycles including interrupt response, prologue, epilogue and reti): ~40
+//! cycles per sample without edge, plus capture_event() for each edge. At
+//! 13.9 kHz that is ~3.5% of the CPU all the time, while the input capture
+//! engine only costs capture_event() per edge, and only while recieving.
+//
+//*****************************************************************************
+ISR (TIMER0_COMPA_vect)
+{
+  bool level;
+
+  g_samples <<= 1;
+  if (_read_bit(PINB, PINB0))
+  {
+    _set_bit(g_samples, 0);
+  }
+
+  level = (MAJORITY_VOTES >> (g_samples & 0x07)) & 0x01;
+  if (level != g_line_level)
   {
-      g_byte_cnt++;
-      g_event_buffer_index = 0;
-      g_is_event_buffer_full = true;
+    g_line_level = level;
+    capture_event(TCNT1 - EDGE_DELAY, level);
   }
 }
+#endif
@@ -16,14 +16,160 @@
 #ifndef __RECIEVER_H__
 #define __RECIEVER_H__
 
+//*****************************************************************************
+//
+//  The following are enumerations for the recieve engines, selected by
+//  IR_Reciever_init(). The oversampling engine is only built with
+//  IR_OVERSAMPLING defined.
+//
+//*****************************************************************************
+
+enum IR_Engine
+{
+  IR_ENGINE_CAPTURE,
+  IR_ENGINE_OVERSAMPLING
+};
+
+//*****************************************************************************
+//
+//  The following are enumerations for the status of each decoded byte, based
+//  on the four error bits of its frame.
+//
+//*****************************************************************************
+
+enum IR_Byte_Status
+{
+  IR_BYTE_OK,
+  IR_BYTE_CORRECTED,
+  IR_BYTE_UNCORRECTABLE
+};
+
+//*****************************************************************************
+//
+//  The following are enumerations for the errors reported to the error
+//  handler.
+//
+//*****************************************************************************
+
+enum IR_Error
+{
+  IR_ERROR_BAD_FRAME,
+  IR_ERROR_UNCORRECTABLE,
+  IR_ERROR_OVERRUN,
+  IR_ERROR_FRAME_DROP
+};
+
+//*****************************************************************************
+//
+//  The following are the types of the handlers called by the decoder, see
+//  IR_on_byte(), IR_on_transmission() and IR_on_error().
+//
+//*****************************************************************************
+
+typedef void (*IR_Byte_Handler)(uint8_t data, uint8_t status);
+typedef void (*IR_Transmission_Handler)(const uint8_t* data,
+                                        const uint8_t* status,
+                                        uint8_t length);
+typedef void (*IR_Error_Handler)(uint8_t error);
+
+//*****************************************************************************
+//
+//  The following structure holds the counters of the reciever since the
+//  initialization, filled by IR_get_stats(). The 16-bit counters wrap
+//  around.
+//  edges: events captured by the ISR.
+//  frames: frames decoded, complete or not.
+//  bytes: bytes queued, whatever their status.
+//  bad_pulses: pulses out of all the width windows.
+//  glitches: pulses under the minimum width, merged with their neighbours.
+//  corrections: bytes fixed with the error bits.
+//  uncorrectable: bytes with more than one bit error.
+//  resyncs: frames cut short by a frame gap.
+//  frame_drops: frames lost because no event buffer was free.
+//  overruns: bytes lost because the queue was full.
+//  max_decode_ticks: longest decoder run, in timer ticks (4 us).
+//
+//*****************************************************************************
+
+struct IR_Stats
+{
+  uint16_t edges;
+  uint16_t frames;
+  uint16_t bytes;
+  uint16_t bad_pulses;
+  uint16_t glitches;
+  uint16_t corrections;
+  uint16_t uncorrectable;
+  uint8_t resyncs;
+  uint8_t frame_drops;
+  uint8_t overruns;
+  uint16_t max_decode_ticks;
+};
+
+//*****************************************************************************
+//
+//  The following structure holds the timing profile of the reciever, in
+//  timer ticks (4 us). It is loaded from the EEPROM by IR_Reciever_init().
+//  min_width - five_quarters_max: nominal pulse width windows for the
+//  opening half bits of each frame (1, 3 and 5 quarters of bit).
+//  transmission_gap: silence that ends a transmission.
+//  guard_time: silence after IR_Reciever_resume().
+//
+//*****************************************************************************
+
+struct IR_Profile
+{
+  uint16_t min_width;
+  uint16_t one_quarter_max;
+  uint16_t three_quarters_max;
+  uint16_t five_quarters_max;
+  uint16_t transmission_gap;
+  uint16_t guard_time;
+};
+
+//*****************************************************************************
+//
+//  The following structure holds the time stamps of one transmission, in
+//  timer ticks (4 us) since the initialization, see IR_get_time().
+//  first_edge, last_edge: capture time of the first and last edge.
+//  delivery: time the transmission was handed to the user.
+//
+//*****************************************************************************
+
+struct IR_Timestamps
+{
+  uint32_t first_edge;
+  uint32_t last_edge;
+  uint32_t delivery;
+};
+
 //*****************************************************************************
 //
 //  Prototypes for the API
 //
 //*****************************************************************************
 
-extern void IR_Reciever_init(void);
-extern uint8_t* IR_get_data(void);
-extern bool IR_is_data_available(void);
+extern void IR_Reciever_init(uint8_t engine);
+extern void IR_Reciever_suspend(void);
+extern void IR_Reciever_resume(void);
+extern void IR_Reciever_set_guard_time(uint16_t guard_time);
+extern void IR_get_profile(struct IR_Profile* profile);
+extern bool IR_set_profile(const struct IR_Profile* profile);
+extern bool IR_calibrate(void);
+extern void IR_save_profile(void);
+extern void IR_process(void);
+extern void IR_on_byte(IR_Byte_Handler handler);
+extern void IR_on_transmission(IR_Transmission_Handler handler);
+extern void IR_on_error(IR_Error_Handler handler);
+extern bool IR_has_pending_events(void);
+extern uint8_t IR_available(void);
+extern uint8_t IR_get_transmission(void);
+extern uint8_t IR_read(uint8_t* status);
+extern void IR_get_timestamps(struct IR_Timestamps* timestamps);
+extern uint32_t IR_get_time(void);
+extern uint8_t IR_get_overruns(void);
+extern uint8_t IR_get_frame_drops(void);
+extern void IR_get_stats(struct IR_Stats* stats);
+extern uint8_t IR_check_codeword(uint16_t codeword, uint8_t* data);
 
 #endif
@@ -6,27 +6,168 @@
 //  Date:     September 30, 2016.
 //  ---------------------------------------------------------------------------
 //  Specifications:
-//  The following code was tested in an atmega328p to read 12 data bytes sent
-//  by a HP 48GX calculator. To read the frame sent by the calculatator a TSOP
-//  1733 was used as IR sensor. The sensor must be connected to PD2, otherwise
-//  the Inpute Capture mode will not work.
+//  The following code was tested in an atmega328p to read the transmissions
+//  sent by a HP 48GX calculator. Each transmission ends on silence, whatever
+//  its number of bytes, and is printed out through the UART with its time
+//  stamps and the error status of each byte, as well as every decoding
+//  error. To read the frame sent by the calculatator a TSOP 1733 was used as
+//  IR sensor. The sensor must be connected to PB0 (ICP1),
+//  otherwise the Inpute Capture mode will not work.
 //
 //*****************************************************************************
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
 #include "ir_reciever.h"
 #include "uart.h"
 
+//*****************************************************************************
+//
+//  The following are defines for the copies printed from the main loop. A
+//  transmission holds up to 32 bytes (the reciever queue).
+//
+//*****************************************************************************
+
+#define PRINT_BYTES                   32
+#define PRINT_ERRORS                  8
+#define PRINT_ERRORS_MASK             (PRINT_ERRORS - 1)
+
+//*****************************************************************************
+//
+//  The following are global variables holding what is left to print. The
+//  handlers only copy the transmission and the errors here, the main loop
+//  prints one line per pass so the decoder keeps running in between.
+//
+//*****************************************************************************
+
+static uint8_t g_print_data[PRINT_BYTES];
+static uint8_t g_print_status[PRINT_BYTES];
+static uint8_t g_print_length;
+static struct IR_Timestamps g_print_timestamps;
+static uint8_t g_print_line;
+static bool g_is_print_pending;
+static uint8_t g_print_skipped;
+
+static uint8_t g_print_errors[PRINT_ERRORS];
+static uint8_t g_error_head;
+static uint8_t g_error_tail;
+
+//*****************************************************************************
+//
+//  Handlers called by the IR reciever after each decode.
+//
+//*****************************************************************************
+
+static void
+copy_transmission(const uint8_t* data, const uint8_t* status, uint8_t length)
+{
+  uint8_t i;
+
+  //
+  //  The UART is far slower than the calculator, a transmission that comes
+  //  while the previous one is still being printed is only counted.
+  //
+  if (g_is_print_pending || length > PRINT_BYTES)
+  {
+    g_print_skipped++;
+    return;
+  }
+
+  IR_get_timestamps(&g_print_timestamps);
+  for (i = 0; i < length; i++)
+  {
+    g_print_data[i] = data[i];
+    g_print_status[i] = status[i];
+  }
+  g_print_length = length;
+  g_print_line = 0;
+  g_is_print_pending = true;
+}
+
+static void
+copy_error(uint8_t error)
+{
+  if ((uint8_t)(g_error_head - g_error_tail) != PRINT_ERRORS)
+  {
+    g_print_errors[g_error_head++ & PRINT_ERRORS_MASK] = error;
+  }
+}
+
+//*****************************************************************************
+//
+//  Prints the next line waiting, about 20 characters (21 ms at 9600 bps),
+//  which is shorter than the two frames the reciever buffers.
+//
+//*****************************************************************************
+
+static void
+print_next_line(void)
+{
+  uint8_t i;
+
+  if (g_error_tail != g_error_head)
+  {
+    UART_printf("Error: %u\n", g_print_errors[g_error_tail++ &
+                                              PRINT_ERRORS_MASK]);
+    return;
+  }
+
+  if (!g_is_print_pending)
+  {
+    return;
+  }
+
+  switch (g_print_line)
+  {
+    case 0:
+      UART_printf("First: %lu\n", g_print_timestamps.first_edge);
+    break;
+
+    case 1:
+      UART_printf("Last: %lu\n", g_print_timestamps.last_edge);
+    break;
+
+    case 2:
+      UART_printf("Delivery: %lu\n", g_print_timestamps.delivery);
+    break;
+
+    case 3:
+      UART_printf("Bytes: %u Skipped: %u\n", g_print_length,
+                  g_print_skipped);
+    break;
+
+    default:
+      i = g_print_line - 4;
+      UART_printf("Byte: %u Status: %u\n", g_print_data[i],
+                  g_print_status[i]);
+    break;
+  }
+
+  g_print_line++;
+  if (g_print_line == g_print_length + 4)
+  {
+    g_is_print_pending = false;
+  }
+}
+
 void main()
 {
-  uint8_t* data;
+  //
+  //  Initialize the IR reciver, every transmission and error is copied by
+  //  its handler and printed out from the main loop.
+  //
+  IR_Reciever_init(IR_ENGINE_CAPTURE);
+  IR_on_transmission(copy_transmission);
+  IR_on_error(copy_error);
 
   //
-  //  Initialize the IR reciver
+  //  The idle sleep mode keeps the timers and the UART running, any of their
+  //  interrupts wakes the MCU up.
   //
-  IR_Reciever_init();
+  set_sleep_mode(SLEEP_MODE_IDLE);
 
   //
   //  Enable global interrupts.
@@ -36,18 +177,29 @@ void main()
   while(1)
   {
     //
-    //  Check if there is any data available
+    //  Decode the captured events, the handlers are called from here.
+    //
+    IR_process();
+
+    //
+    //  Print one line at a time, the decoder runs again before the next.
+    //
+    print_next_line();
+
+    //
+    //  Sleep until the next interrupt unless the reciever has pending work.
+    //  Interrupts are disabled during the check, sei() only takes effect
+    //  after the next instruction, so no wake up is missed.
     //
-    if(IR_is_data_available())
+    cli();
+    if (!IR_has_pending_events() && !g_is_print_pending &&
+        g_error_tail == g_error_head)
     {
-      //
-      //  Get the data from the IR reciever and print it out
-      //
-      data = IR_get_data();
-      for (uint8_t i = 0; i < 12; i++)
-      {
-        UART_printf("Byte: %u\n", *data++);
-      }
+      sleep_enable();
+      sei();
+      sleep_cpu();
+      sleep_disable();
     }
+    sei();
   }
 }
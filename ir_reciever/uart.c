@@ -246,7 +246,8 @@ void UART_write_udec(uint32_t n)
 //! @brief Print a predefined string fromat.
 //!
 //! This function loops through a predefined string format and insertes the
-//! the list arguments in the right positions.
+//! the list arguments in the right positions. Supports %c, %s, %u for an
+//! unsigned int and %lu for a uint32_t.
 //!
 //! @param[in] format String output format.
 //! @param[in] ... List of arguments to be inserted within the format.
@@ -263,7 +264,7 @@ void UART_printf(char* format, ...)
 	//	Initialize printf arguments.
 	//
 	va_list arg;
-	va_strat(arg, format);
+	va_start(arg, format);
 
 	//
 	//	Loop through the entire string format.
@@ -289,14 +290,25 @@ void UART_printf(char* format, ...)
 				//	Char.
 				//
 				case 'c':
-					UART_write_char(va_arg(arg, char));
+					UART_write_char((char)va_arg(arg, int));
 				break;
 
 				//
 				//	Integer.
 				//
 				case 'u':
-					UART_write_udec(va_arg(arg, int));
+					UART_write_udec(va_arg(arg, unsigned int));
+				break;
+
+				//
+				//	Long integer (%lu), passed as 32 bits.
+				//
+				case 'l':
+					if (*(traverse + 1) == 'u')
+					{
+						traverse++;
+					}
+					UART_write_udec(va_arg(arg, uint32_t));
 				break;
 
 				//
@@ -308,4 +320,6 @@ void UART_printf(char* format, ...)
 			}
 		}
 	}
+
+	va_end(arg);
 }